@@ -0,0 +1,135 @@
+/*********************************************************************************
+* BufferPool.c
+* Size-Classed Buffer Pool
+*********************************************************************************/
+
+#include "BufferPool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CLASSES      4 // 1 KiB, 4 KiB, 16 KiB, 64 KiB
+#define LOCAL_MAX    8
+#define SHARED_MAX   256
+#define SHARED_BATCH 4
+
+// ----- Structs -----
+
+// Sits in front of every buffer handed out. 16 bytes, so buffers keep the
+// alignment malloc gave them.
+typedef struct BufHdr {
+    struct BufHdr *next;
+    size_t cls;
+} BufHdr;
+
+// Free buffers are cached per thread first, so the common get/put pair takes
+// no lock. Threads that free more than they allocate spill to the shared list.
+typedef struct FreeList {
+    BufHdr *head;
+    int count;
+} FreeList;
+
+static __thread FreeList local[CLASSES];
+static FreeList shared[CLASSES];
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ----- Helper Functions -----
+
+static size_t class_size(size_t cls) {
+    return (size_t) BUFFER_MIN << (2 * cls);
+}
+
+static size_t class_of(size_t size) {
+    size_t cls = 0;
+    while (cls < CLASSES - 1 && class_size(cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+static BufHdr *header(char *buf) {
+    return (BufHdr *) buf - 1;
+}
+
+// ----- Access Functions -----
+
+// Returns the capacity of buf.
+size_t bufferSize(char *buf) {
+    return class_size(header(buf)->cls);
+}
+
+// ----- Manipulation Procedures -----
+
+// Returns a buffer of the smallest class holding size bytes, at most
+// BUFFER_MAX. Exits if memory is exhausted.
+char *bufferGet(size_t size) {
+    size_t cls = class_of(size);
+    FreeList *l = &local[cls];
+
+    if (l->head == NULL) {
+        pthread_mutex_lock(&shared_lock);
+        for (int i = 0; i < SHARED_BATCH && shared[cls].head != NULL; i++) {
+            BufHdr *h = shared[cls].head;
+            shared[cls].head = h->next;
+            shared[cls].count--;
+            h->next = l->head;
+            l->head = h;
+            l->count++;
+        }
+        pthread_mutex_unlock(&shared_lock);
+    }
+
+    BufHdr *h = l->head;
+    if (h != NULL) {
+        l->head = h->next;
+        l->count--;
+    } else {
+        h = malloc(sizeof(BufHdr) + class_size(cls));
+        if (h == NULL) {
+            fprintf(stderr, "BufferPool Error: out of memory\n");
+            exit(1);
+        }
+        h->cls = cls;
+    }
+    return (char *) (h + 1);
+}
+
+// Returns buf to the pool.
+void bufferPut(char *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    BufHdr *h = header(buf);
+    FreeList *l = &local[h->cls];
+
+    if (l->count < LOCAL_MAX) {
+        h->next = l->head;
+        l->head = h;
+        l->count++;
+        return;
+    }
+    pthread_mutex_lock(&shared_lock);
+    if (shared[h->cls].count < SHARED_MAX) {
+        h->next = shared[h->cls].head;
+        shared[h->cls].head = h;
+        shared[h->cls].count++;
+        h = NULL;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    free(h);
+}
+
+// Moves the first used bytes of buf into a buffer of the next class and
+// returns that, or returns NULL and keeps buf if it is already BUFFER_MAX.
+char *bufferGrow(char *buf, size_t used) {
+    size_t cls = header(buf)->cls;
+    if (cls == CLASSES - 1) {
+        return NULL;
+    }
+    char *bigger = bufferGet(class_size(cls + 1));
+    memcpy(bigger, buf, used);
+    bufferPut(buf);
+    return bigger;
+}
@@ -0,0 +1,19 @@
+/*********************************************************************************
+* BufferPool.h
+* Size-Classed Buffer Pool Header File
+*********************************************************************************/
+
+#ifndef __BUFFERPOOL_H__
+#define __BUFFERPOOL_H__
+
+#include <stddef.h>
+
+#define BUFFER_MIN 1024
+#define BUFFER_MAX (64 * 1024)
+
+char *bufferGet(size_t size);
+size_t bufferSize(char *buf);
+char *bufferGrow(char *buf, size_t used);
+void bufferPut(char *buf);
+
+#endif
@@ -0,0 +1,309 @@
+/*********************************************************************************
+* Coroutine.c
+* Green Thread Scheduler
+*********************************************************************************/
+
+#include "Coroutine.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define STACK_SIZE (64 * 1024)
+#define GUARD_SIZE 4096
+#define POOL_MAX   256
+#define MAX_EVENTS 64
+
+// ----- Structs -----
+
+typedef struct CoroutineObj *Coroutine;
+
+typedef struct CoroutineObj {
+    ucontext_t ctx;
+    char *stack;
+    void (*fn)(void *arg);
+    void *arg;
+    bool done;
+    bool yielded;
+    Coroutine next;
+} CoroutineObj;
+
+// One per OS thread. Runnable coroutines sit on runq; coroutines blocked on a
+// file descriptor are only referenced from the epoll set, and ones blocked on
+// a CoWaitList only from it. Other threads hand woken coroutines over through
+// inbox and signal wakefd, which is in the epoll set.
+typedef struct SchedulerObj {
+    ucontext_t main;
+    int epfd;
+    int wakefd;
+    pthread_mutex_t inbox_lock;
+    Coroutine inbox;
+    Coroutine head;
+    Coroutine tail;
+    int runnable;
+    int yields;
+    Coroutine pool;
+    int pooled;
+    int live;
+    Coroutine current;
+} SchedulerObj;
+
+// A coroutine parked on a CoWaitList; lives on the coroutine's own stack.
+typedef struct CoWaiterObj {
+    Coroutine C;
+    Scheduler S;
+    struct CoWaiterObj *next;
+} CoWaiterObj;
+
+static __thread Scheduler self;
+
+// ----- Constructors - Destructors -----
+
+// Creates and returns a new Scheduler and makes it the calling thread's.
+Scheduler newScheduler(void) {
+    Scheduler S = calloc(1, sizeof(SchedulerObj));
+    S->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (S->epfd < 0) {
+        fprintf(stderr, "Scheduler Error: epoll_create1() failed\n");
+        exit(1);
+    }
+    S->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (S->wakefd < 0 || epoll_ctl(S->epfd, EPOLL_CTL_ADD, S->wakefd, &ev) < 0) {
+        fprintf(stderr, "Scheduler Error: eventfd() failed\n");
+        exit(1);
+    }
+    pthread_mutex_init(&S->inbox_lock, NULL);
+    self = S;
+    return S;
+}
+
+static void freeCoroutine(Coroutine C) {
+    munmap(C->stack, STACK_SIZE + GUARD_SIZE);
+    free(C);
+}
+
+// Frees all heap memory associated with *pS. Coroutines still blocked are
+// abandoned along with their stacks.
+void freeScheduler(Scheduler *pS) {
+    if (pS == NULL || *pS == NULL) {
+        return;
+    }
+    Scheduler S = *pS;
+    while (S->pool != NULL) {
+        Coroutine C = S->pool;
+        S->pool = C->next;
+        freeCoroutine(C);
+    }
+    close(S->epfd);
+    close(S->wakefd);
+    pthread_mutex_destroy(&S->inbox_lock);
+    if (self == S) {
+        self = NULL;
+    }
+    free(S);
+    *pS = NULL;
+}
+
+// ----- Access Functions -----
+
+// Returns the number of coroutines of S that have not finished.
+int coLive(Scheduler S) {
+    return S->live;
+}
+
+// Returns true iff the caller runs in a coroutine rather than on a plain
+// OS thread stack.
+bool coActive(void) {
+    return self != NULL && self->current != NULL;
+}
+
+// ----- Manipulation Procedures -----
+
+static void enqueue(Scheduler S, Coroutine C) {
+    C->next = NULL;
+    if (S->tail == NULL) {
+        S->head = C;
+    } else {
+        S->tail->next = C;
+    }
+    S->tail = C;
+    S->runnable++;
+    if (C->yielded) {
+        S->yields++;
+    }
+}
+
+static Coroutine dequeue(Scheduler S) {
+    Coroutine C = S->head;
+    S->head = C->next;
+    if (S->head == NULL) {
+        S->tail = NULL;
+    }
+    S->runnable--;
+    if (C->yielded) {
+        S->yields--;
+        C->yielded = false;
+    }
+    return C;
+}
+
+static void trampoline(unsigned lo, unsigned hi) {
+    Coroutine C = (Coroutine) (((uintptr_t) hi << 16 << 16) | (uintptr_t) lo);
+    C->fn(C->arg);
+    C->done = true;
+    setcontext(&self->main);
+}
+
+// Starts fn(arg) on a pooled stack. It first runs on the next coRun().
+void coSpawn(Scheduler S, void (*fn)(void *arg), void *arg) {
+    Coroutine C = S->pool;
+    if (C != NULL) {
+        S->pool = C->next;
+        S->pooled--;
+    } else {
+        C = calloc(1, sizeof(CoroutineObj));
+        C->stack = mmap(NULL, STACK_SIZE + GUARD_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (C->stack == MAP_FAILED) {
+            fprintf(stderr, "Scheduler Error: could not allocate stack\n");
+            exit(1);
+        }
+        mprotect(C->stack, GUARD_SIZE, PROT_NONE);
+    }
+    uintptr_t p = (uintptr_t) C;
+    getcontext(&C->ctx);
+    C->ctx.uc_stack.ss_sp = C->stack + GUARD_SIZE;
+    C->ctx.uc_stack.ss_size = STACK_SIZE;
+    C->ctx.uc_link = NULL;
+    makecontext(&C->ctx, (void (*)(void)) trampoline, 2, (unsigned) p, (unsigned) (p >> 16 >> 16));
+    C->fn = fn;
+    C->arg = arg;
+    C->done = false;
+    C->yielded = false;
+    S->live++;
+    enqueue(S, C);
+}
+
+// Runs every coroutine that is runnable, then waits up to timeout_ms for
+// file descriptors to become ready. Does not wait while work is queued.
+void coRun(Scheduler S, int timeout_ms) {
+    for (int n = S->runnable; n > 0; n--) {
+        Coroutine C = dequeue(S);
+        S->current = C;
+        swapcontext(&S->main, &C->ctx);
+        S->current = NULL;
+        if (C->done) {
+            S->live--;
+            if (S->pooled < POOL_MAX) {
+                C->next = S->pool;
+                S->pool = C;
+                S->pooled++;
+            } else {
+                freeCoroutine(C);
+            }
+        }
+    }
+
+    // coroutines that only yielded are retrying something; back off a little
+    if (S->runnable > 0) {
+        timeout_ms = S->yields == S->runnable ? 1 : 0;
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(S->epfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr != NULL) {
+            enqueue(S, events[i].data.ptr);
+            continue;
+        }
+        uint64_t count;
+        read(S->wakefd, &count, sizeof count);
+        pthread_mutex_lock(&S->inbox_lock);
+        Coroutine C = S->inbox;
+        S->inbox = NULL;
+        pthread_mutex_unlock(&S->inbox_lock);
+        while (C != NULL) {
+            Coroutine next = C->next;
+            enqueue(S, C);
+            C = next;
+        }
+    }
+}
+
+// Puts the running coroutine at the back of the run queue.
+void coYield(void) {
+    Coroutine C = self->current;
+    C->yielded = true;
+    enqueue(self, C);
+    swapcontext(&C->ctx, &self->main);
+}
+
+// Parks the running coroutine until fd reports one of events.
+void coWaitFd(int fd, int events) {
+    Coroutine C = self->current;
+    struct epoll_event ev = { .events = events | EPOLLONESHOT, .data.ptr = C };
+
+    if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT || epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            coYield();
+            return;
+        }
+    }
+    swapcontext(&C->ctx, &self->main);
+}
+
+// Parks the running coroutine on W until woken. mutex is held by the caller,
+// released while parked and held again on return, as with
+// pthread_cond_wait(); the caller rechecks its condition.
+void coWait(CoWaitList *W, pthread_mutex_t *mutex) {
+    CoWaiterObj w = { self->current, self, NULL };
+    if (W->tail == NULL) {
+        W->head = &w;
+    } else {
+        W->tail->next = &w;
+    }
+    W->tail = &w;
+    // a wake from another thread before the switch only queues w.C on the
+    // inbox, which is not read until this thread is back in coRun()
+    pthread_mutex_unlock(mutex);
+    swapcontext(&w.C->ctx, &self->main);
+    pthread_mutex_lock(mutex);
+}
+
+// Makes the first coroutine on W runnable again on its own scheduler.
+// The caller holds W's mutex.
+void coWakeOne(CoWaitList *W) {
+    CoWaiterObj *w = W->head;
+    if (w == NULL) {
+        return;
+    }
+    W->head = w->next;
+    if (W->head == NULL) {
+        W->tail = NULL;
+    }
+    Coroutine C = w->C;
+    Scheduler S = w->S; // w is gone once C runs
+    if (S == self) {
+        enqueue(S, C);
+        return;
+    }
+    pthread_mutex_lock(&S->inbox_lock);
+    C->next = S->inbox;
+    S->inbox = C;
+    pthread_mutex_unlock(&S->inbox_lock);
+    uint64_t one = 1;
+    write(S->wakefd, &one, sizeof one);
+}
+
+// Wakes every coroutine on W. The caller holds W's mutex.
+void coWakeAll(CoWaitList *W) {
+    while (W->head != NULL) {
+        coWakeOne(W);
+    }
+}
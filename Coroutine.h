@@ -0,0 +1,35 @@
+/*********************************************************************************
+* Coroutine.h
+* Green Thread Scheduler Header File
+*********************************************************************************/
+
+#ifndef __COROUTINE_H__
+#define __COROUTINE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef struct SchedulerObj *Scheduler;
+
+// Coroutines parked on a condition, possibly of several schedulers. Guarded
+// by the mutex the condition is checked under; zero-initialised is empty.
+typedef struct CoWaitList {
+    struct CoWaiterObj *head;
+    struct CoWaiterObj *tail;
+} CoWaitList;
+
+Scheduler newScheduler(void);
+void freeScheduler(Scheduler *pS);
+
+int coLive(Scheduler S);
+bool coActive(void);
+
+void coSpawn(Scheduler S, void (*fn)(void *arg), void *arg);
+void coRun(Scheduler S, int timeout_ms);
+void coYield(void);
+void coWaitFd(int fd, int events);
+void coWait(CoWaitList *W, pthread_mutex_t *mutex);
+void coWakeOne(CoWaitList *W);
+void coWakeAll(CoWaitList *W);
+
+#endif
@@ -0,0 +1,239 @@
+/*********************************************************************************
+* RateLimit.c
+* Per-Client Rate Limiter
+*********************************************************************************/
+
+#include "RateLimit.h"
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SHARDS      64
+#define SHARD_SLOTS 64 // also the longest probe
+#define FIND_TRIES  4
+#define ELAPSED_MAX (1 << 22)
+
+// ----- Structs -----
+
+// One client: an IPv4 address or an IPv6 /64. Each bucket is a single word
+// holding the signed token count in the high 32 bits and the ms timestamp of
+// its last refill in the low 32, so it is updated with one CAS. key is 0 while
+// the slot is unused, and a slot is never emptied again, only taken over by
+// another client once its shard is full and it has no open connections.
+typedef struct Slot {
+    _Atomic uint64_t key;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t bytes;
+    _Atomic uint32_t conns;
+    _Atomic uint32_t seen;
+} Slot;
+
+// A client hashes to one shard of SHARD_SLOTS slots and is only ever looked
+// for there, so memory and lookup cost are fixed. Request tokens are counted
+// in thousandths so rates below one per millisecond still refill.
+typedef struct RateLimitObj {
+    long requests;
+    long bytes;
+    uint32_t conns;
+    Slot slots[SHARDS * SHARD_SLOTS];
+} RateLimitObj;
+
+// ----- Helpers -----
+
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint64_t pack(int64_t tokens, uint32_t stamp) {
+    if (tokens < INT32_MIN) {
+        tokens = INT32_MIN;
+    }
+    return (uint64_t) (uint32_t) (int32_t) tokens << 32 | stamp;
+}
+
+// A full bucket holds one second's worth of tokens.
+static int64_t burstOf(long rate) {
+    return rate < INT32_MAX ? rate : INT32_MAX;
+}
+
+// Refills bucket b at rate tokens per second and takes cost from it. Without
+// debt it fails instead of going below zero.
+static bool bucketTake(_Atomic uint64_t *b, long rate, uint32_t now, long cost, bool debt) {
+    int64_t burst = burstOf(rate);
+    uint64_t old = atomic_load(b), new;
+    do {
+        int64_t tokens = (int32_t) (old >> 32);
+        uint32_t stamp = (uint32_t) old;
+        uint32_t elapsed = now - stamp;
+        int64_t add = (int64_t) (elapsed < ELAPSED_MAX ? elapsed : ELAPSED_MAX) * rate / 1000;
+        if (add > 0) {
+            // the stamp only moves when a token was added, so slow rates
+            // are not rounded away
+            stamp = now;
+            tokens = tokens + add < burst ? tokens + add : burst;
+        }
+        if (!debt && tokens < cost) {
+            return false;
+        }
+        new = pack(tokens - cost, stamp);
+    } while (!atomic_compare_exchange_weak(b, &old, new));
+    return true;
+}
+
+// Returns a non-zero key for the client at peer, or 0 if it is not an IP
+// client.
+static uint64_t peerKey(const struct sockaddr *peer) {
+    uint64_t raw;
+    if (peer->sa_family == AF_INET) {
+        raw = 1ULL << 32 | ((const struct sockaddr_in *) peer)->sin_addr.s_addr;
+    } else if (peer->sa_family == AF_INET6) {
+        const struct in6_addr *a = &((const struct sockaddr_in6 *) peer)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a)) {
+            uint32_t v4;
+            memcpy(&v4, &a->s6_addr[12], sizeof v4);
+            raw = 1ULL << 32 | v4;
+        } else {
+            memcpy(&raw, a->s6_addr, sizeof raw);
+        }
+    } else {
+        return 0;
+    }
+    // splitmix64 finalizer
+    raw = (raw ^ (raw >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    raw = (raw ^ (raw >> 27)) * 0x94d049bb133111ebULL;
+    return (raw ^ (raw >> 31)) | 1;
+}
+
+// Sets up s for a new client.
+static void slotReset(RateLimit R, Slot *s, uint32_t now) {
+    atomic_store(&s->requests, pack(burstOf(R->requests * 1000), now));
+    atomic_store(&s->bytes, pack(burstOf(R->bytes), now));
+    atomic_store(&s->seen, now);
+}
+
+// Returns the slot of key, taking a free one in its shard if it has none, or
+// else the one without open connections that was seen longest ago. NULL if
+// every slot of the shard has open connections or the take-over raced.
+static Slot *slotFind(RateLimit R, uint64_t key, uint32_t now) {
+    Slot *shard = &R->slots[(key >> 32) % SHARDS * SHARD_SLOTS];
+    Slot *oldest = NULL;
+    uint64_t oldest_key = 0;
+    int32_t oldest_age = 0;
+
+    for (int i = 0; i < SHARD_SLOTS; i++) {
+        Slot *s = &shard[(key + i) % SHARD_SLOTS];
+        uint64_t k = atomic_load(&s->key);
+        if (k == key) {
+            return s;
+        }
+        if (k == 0) {
+            // keys fill a shard in probe order, so key is not further on
+            if (atomic_compare_exchange_strong(&s->key, &k, key)) {
+                slotReset(R, s, now);
+                return s;
+            }
+            if (k == key) {
+                return s;
+            }
+            continue;
+        }
+        int32_t age = (int32_t) (now - atomic_load(&s->seen));
+        if (atomic_load(&s->conns) == 0 && (oldest == NULL || age > oldest_age)) {
+            oldest = s;
+            oldest_key = k;
+            oldest_age = age;
+        }
+    }
+    if (oldest != NULL && atomic_compare_exchange_strong(&oldest->key, &oldest_key, key)) {
+        slotReset(R, oldest, now);
+        return oldest;
+    }
+    return NULL;
+}
+
+// ----- Constructors - Destructors -----
+
+// Creates a limiter allowing each client requests per second, bytes per
+// second and conns connections at once. 0 turns a limit off.
+RateLimit newRateLimit(long requests, long bytes, int conns) {
+    RateLimit R = calloc(1, sizeof(RateLimitObj));
+    if (R == NULL) {
+        return NULL;
+    }
+    R->requests = requests;
+    R->bytes = bytes;
+    R->conns = conns;
+    return R;
+}
+
+// Frees all heap memory associated with *pR.
+void freeRateLimit(RateLimit *pR) {
+    if (pR == NULL || *pR == NULL) {
+        return;
+    }
+    free(*pR);
+    *pR = NULL;
+}
+
+// ----- Manipulation Procedures -----
+
+// Checks a new connection from peer against its client's limits and takes a
+// request token. Returns the client's slot, to be passed to rateDone,
+// RATE_NONE if it is admitted untracked (not an IP client), or RATE_DENY if
+// the client is over a limit or no slot could be had for it: failing open
+// there would let a client that fills its shard go unlimited.
+int rateAdmit(RateLimit R, const struct sockaddr *peer) {
+    uint64_t key = peerKey(peer);
+    if (key == 0) {
+        return RATE_NONE;
+    }
+    uint32_t now = now_ms();
+    Slot *s = NULL;
+    uint32_t conns = 0;
+    for (int tries = 0; s == NULL && tries < FIND_TRIES; tries++) {
+        s = slotFind(R, key, now);
+        if (s == NULL) {
+            continue;
+        }
+        conns = atomic_fetch_add(&s->conns, 1);
+        atomic_store(&s->seen, now);
+        if (atomic_load(&s->key) != key) {
+            // taken over between finding and counting it
+            atomic_fetch_sub(&s->conns, 1);
+            s = NULL;
+        }
+    }
+    if (s == NULL) {
+        return RATE_DENY;
+    }
+    if ((R->conns > 0 && conns >= R->conns)
+        || (R->bytes > 0 && !bucketTake(&s->bytes, R->bytes, now, 0, false))
+        || (R->requests > 0 && !bucketTake(&s->requests, R->requests * 1000, now, 1000, false))) {
+        atomic_fetch_sub(&s->conns, 1);
+        return RATE_DENY;
+    }
+    return s - R->slots;
+}
+
+// Ends a connection admitted into slot, charging the bytes it transferred.
+// A client can go into debt on one large transfer and is refused until it is
+// paid back.
+void rateDone(RateLimit R, int slot, long bytes) {
+    if (slot < 0) {
+        return;
+    }
+    Slot *s = &R->slots[slot];
+    uint32_t now = now_ms();
+    if (R->bytes > 0) {
+        bucketTake(&s->bytes, R->bytes, now, bytes, true);
+    }
+    atomic_store(&s->seen, now);
+    atomic_fetch_sub(&s->conns, 1);
+}
@@ -0,0 +1,22 @@
+/*********************************************************************************
+* RateLimit.h
+* Per-Client Rate Limiter Header File
+*********************************************************************************/
+
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <sys/socket.h>
+
+#define RATE_NONE -1 // admitted, but not tracked
+#define RATE_DENY -2 // over a limit
+
+typedef struct RateLimitObj *RateLimit;
+
+RateLimit newRateLimit(long requests, long bytes, int conns);
+void freeRateLimit(RateLimit *pR);
+
+int rateAdmit(RateLimit R, const struct sockaddr *peer);
+void rateDone(RateLimit R, int slot, long bytes);
+
+#endif
@@ -0,0 +1,690 @@
+/*********************************************************************************
+* Store.c
+* Log-Structured Object Store
+*********************************************************************************/
+
+#include "Store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SEGMENT_MAX   (64L * 1024 * 1024)
+#define RECORD_MAGIC  0x4c535452u
+#define FOOTER_MAGIC  0x4c534654u
+#define INDEX_BUCKETS 65536
+#define KEY_MAX       255
+#define COPY_SIZE     65536
+#define COMPACT_LIVE  0.5
+
+enum { REC_PUT = 1, REC_APPEND = 2 };
+
+// ----- Structs -----
+
+// Every object write is one record: header, key, then the body.
+typedef struct RecordHeader {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t keylen;
+    uint64_t len;
+} RecordHeader;
+
+// A sealed segment ends with one FooterEntry (followed by its key) per record
+// and a Trailer, so startup can rebuild the index without reading bodies.
+typedef struct FooterEntry {
+    uint64_t off;
+    uint64_t len;
+    uint16_t type;
+    uint16_t keylen;
+    uint32_t pad;
+} FooterEntry;
+
+typedef struct Trailer {
+    uint64_t footer_off;
+    uint32_t count;
+    uint32_t magic;
+} Trailer;
+
+typedef struct Extent {
+    uint32_t seg;
+    uint64_t off;
+    uint64_t len;
+} Extent;
+
+// An object is the concatenation of its extents: the last PUT and every
+// APPEND since. The last PUT is also kept by where its body starts, since an
+// empty one has no extent but must outlive the records it replaced.
+typedef struct EntryObj *Entry;
+
+typedef struct EntryObj {
+    char *key;
+    Extent *ext;
+    int n;
+    int cap;
+    uint64_t size;
+    uint32_t put_seg;
+    uint64_t put_off;
+    Entry next;
+} EntryObj;
+
+typedef struct Segment {
+    int fd;
+    bool sealed;
+    bool packed; // rewritten by compaction and nothing overwritten since
+    uint64_t size;
+    uint64_t live;
+    char *footer;
+    size_t footer_len;
+    size_t footer_cap;
+    uint32_t count;
+} Segment;
+
+// A live record of the segment being compacted and where its copy went.
+typedef struct Move {
+    Entry e;
+    int type;
+    uint64_t off;
+    uint64_t len;
+    uint64_t new_off;
+} Move;
+
+typedef struct StoreObj {
+    char *dir;
+    Segment *segs;
+    uint32_t nsegs;
+    uint32_t active;
+    Entry buckets[INDEX_BUCKETS];
+    pthread_mutex_t lock;
+    bool pending;
+    bool pending_append;
+    char pending_key[KEY_MAX + 1];
+    uint64_t pending_off;
+    pthread_mutex_t compact; // held while a compaction copies
+    int victim;
+    int compact_fd;
+    uint64_t compact_size;
+    Move *moves;
+    int nmoves;
+} StoreObj;
+
+// ----- Index -----
+
+static unsigned hash(const char *key) {
+    unsigned h = 5381;
+    for (const char *c = key; *c; c++) {
+        h = h * 33 + (unsigned char) *c;
+    }
+    return h % INDEX_BUCKETS;
+}
+
+static Entry lookup(Store S, const char *key) {
+    for (Entry e = S->buckets[hash(key)]; e != NULL; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Applies one record to the index and the live byte counts of the segments.
+static void apply(Store S, const char *key, int type, uint32_t seg, uint64_t off, uint64_t len) {
+    Entry e = lookup(S, key);
+    if (e == NULL) {
+        unsigned h = hash(key);
+        e = calloc(1, sizeof(EntryObj));
+        e->key = strdup(key);
+        e->next = S->buckets[h];
+        S->buckets[h] = e;
+    }
+    if (type == REC_PUT) {
+        for (int i = 0; i < e->n; i++) {
+            S->segs[e->ext[i].seg].live -= e->ext[i].len;
+            S->segs[e->ext[i].seg].packed = false;
+        }
+        e->n = 0;
+        e->size = 0;
+        e->put_seg = seg;
+        e->put_off = off;
+    }
+    if (len == 0) {
+        return;
+    }
+    if (e->n == e->cap) {
+        e->cap = e->cap ? e->cap * 2 : 1;
+        e->ext = realloc(e->ext, e->cap * sizeof(Extent));
+    }
+    e->ext[e->n++] = (Extent) { seg, off, len };
+    e->size += len;
+    S->segs[seg].live += len;
+}
+
+// ----- Segments -----
+
+static char *segment_path(Store S, uint32_t id) {
+    char *path = malloc(strlen(S->dir) + 32);
+    sprintf(path, "%s/seg-%08u.log", S->dir, id);
+    return path;
+}
+
+// The file a segment is rewritten into before it replaces the segment.
+static char *compact_path(Store S) {
+    char *path = malloc(strlen(S->dir) + 32);
+    sprintf(path, "%s/compact.tmp", S->dir);
+    return path;
+}
+
+static void footer_add(Segment *g, const char *key, int type, uint64_t off, uint64_t len) {
+    FooterEntry f = { off, len, type, strlen(key), 0 };
+    size_t need = g->footer_len + sizeof f + f.keylen;
+    if (need > g->footer_cap) {
+        g->footer_cap = need * 2;
+        g->footer = realloc(g->footer, g->footer_cap);
+    }
+    memcpy(g->footer + g->footer_len, &f, sizeof f);
+    memcpy(g->footer + g->footer_len + sizeof f, key, f.keylen);
+    g->footer_len = need;
+    g->count++;
+}
+
+// Writes the footer and trailer of segment g, after which it is read-only.
+static void seal(Segment *g) {
+    Trailer t = { g->size, g->count, FOOTER_MAGIC };
+    if (pwrite(g->fd, g->footer, g->footer_len, g->size) == (ssize_t) g->footer_len
+        && pwrite(g->fd, &t, sizeof t, g->size + g->footer_len) == sizeof t) {
+        g->size += g->footer_len + sizeof t;
+    }
+    free(g->footer);
+    g->footer = NULL;
+    g->footer_len = g->footer_cap = 0;
+    g->sealed = true;
+}
+
+static Segment *grow(Store S, uint32_t n) {
+    if (n > S->nsegs) {
+        S->segs = realloc(S->segs, n * sizeof(Segment));
+        for (uint32_t i = S->nsegs; i < n; i++) {
+            memset(&S->segs[i], 0, sizeof(Segment));
+            S->segs[i].fd = -1;
+        }
+        S->nsegs = n;
+    }
+    return &S->segs[n - 1];
+}
+
+// Seals the active segment and starts a new one.
+static int roll(Store S) {
+    if (S->nsegs > 0 && S->segs[S->active].fd >= 0 && !S->segs[S->active].sealed) {
+        seal(&S->segs[S->active]);
+    }
+    uint32_t id = S->nsegs;
+    char *path = segment_path(S, id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    free(path);
+    if (fd < 0) {
+        return -1;
+    }
+    Segment *g = grow(S, id + 1);
+    g->fd = fd;
+    S->active = id;
+    return 0;
+}
+
+// Rebuilds the index from the footer of a sealed segment.
+static bool load_footer(Store S, uint32_t id) {
+    Segment *g = &S->segs[id];
+    Trailer t;
+    if (g->size < sizeof t || pread(g->fd, &t, sizeof t, g->size - sizeof t) != sizeof t
+        || t.magic != FOOTER_MAGIC || t.footer_off > g->size - sizeof t) {
+        return false;
+    }
+    size_t len = g->size - sizeof t - t.footer_off;
+    char *buf = malloc(len);
+    if (pread(g->fd, buf, len, t.footer_off) != (ssize_t) len) {
+        free(buf);
+        return false;
+    }
+    char key[KEY_MAX + 1];
+    size_t pos = 0;
+    for (uint32_t i = 0; i < t.count && pos + sizeof(FooterEntry) <= len; i++) {
+        FooterEntry f;
+        memcpy(&f, buf + pos, sizeof f);
+        if (f.keylen > KEY_MAX || pos + sizeof f + f.keylen > len) {
+            break;
+        }
+        memcpy(key, buf + pos + sizeof f, f.keylen);
+        key[f.keylen] = '\0';
+        apply(S, key, f.type, id, f.off, f.len);
+        pos += sizeof f + f.keylen;
+    }
+    free(buf);
+    g->sealed = true;
+    return true;
+}
+
+// Rebuilds the index of an unsealed segment by walking its record headers.
+// A torn record at the end, from a crash mid-write, is cut off.
+static void load_scan(Store S, uint32_t id) {
+    Segment *g = &S->segs[id];
+    uint64_t pos = 0;
+    char key[KEY_MAX + 1];
+    RecordHeader h;
+
+    while (pread(g->fd, &h, sizeof h, pos) == sizeof h) {
+        uint64_t off = pos + sizeof h + h.keylen;
+        if (h.magic != RECORD_MAGIC || (h.type != REC_PUT && h.type != REC_APPEND)
+            || h.keylen == 0 || h.keylen > KEY_MAX || off > g->size || h.len > g->size - off
+            || pread(g->fd, key, h.keylen, pos + sizeof h) != h.keylen) {
+            break;
+        }
+        key[h.keylen] = '\0';
+        apply(S, key, h.type, id, off, h.len);
+        footer_add(g, key, h.type, off, h.len);
+        pos = off + h.len;
+    }
+    if (pos < g->size && ftruncate(g->fd, pos) == 0) {
+        g->size = pos;
+    }
+}
+
+// ----- Constructors - Destructors -----
+
+// Opens the store in dir, creating it if needed, and rebuilds the index.
+// Returns NULL on error.
+Store newStore(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return NULL;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return NULL;
+    }
+    Store S = calloc(1, sizeof(StoreObj));
+    S->dir = strdup(dir);
+    pthread_mutex_init(&S->lock, NULL);
+    pthread_mutex_init(&S->compact, NULL);
+    S->victim = S->compact_fd = -1;
+
+    struct dirent *de;
+    unsigned id;
+    while ((de = readdir(d)) != NULL) {
+        if (sscanf(de->d_name, "seg-%08u.log", &id) == 1) {
+            grow(S, id + 1);
+        }
+    }
+    closedir(d);
+
+    int last = -1;
+    for (uint32_t i = 0; i < S->nsegs; i++) {
+        char *path = segment_path(S, i);
+        Segment *g = &S->segs[i];
+        g->fd = open(path, O_RDWR | O_CLOEXEC);
+        free(path);
+        if (g->fd < 0) {
+            continue;
+        }
+        struct stat st;
+        fstat(g->fd, &st);
+        g->size = st.st_size;
+        if (!load_footer(S, i)) {
+            load_scan(S, i);
+        }
+        if (last >= 0 && !S->segs[last].sealed) {
+            seal(&S->segs[last]);
+        }
+        last = i;
+    }
+    if (last >= 0 && !S->segs[last].sealed) {
+        S->active = last;
+    } else if (roll(S) < 0) {
+        freeStore(&S);
+        return NULL;
+    }
+    return S;
+}
+
+// Frees all heap memory associated with *pS and seals nothing, so the active
+// segment is rescanned on the next start.
+void freeStore(Store *pS) {
+    if (pS == NULL || *pS == NULL) {
+        return;
+    }
+    Store S = *pS;
+    pthread_mutex_lock(&S->compact);
+    if (S->compact_fd >= 0) {
+        char *tmp = compact_path(S);
+        unlink(tmp);
+        free(tmp);
+        close(S->compact_fd);
+    }
+    free(S->moves);
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        while (S->buckets[i] != NULL) {
+            Entry e = S->buckets[i];
+            S->buckets[i] = e->next;
+            free(e->key);
+            free(e->ext);
+            free(e);
+        }
+    }
+    for (uint32_t i = 0; i < S->nsegs; i++) {
+        if (S->segs[i].fd >= 0) {
+            close(S->segs[i].fd);
+        }
+        free(S->segs[i].footer);
+    }
+    free(S->segs);
+    free(S->dir);
+    pthread_mutex_destroy(&S->lock);
+    pthread_mutex_unlock(&S->compact);
+    pthread_mutex_destroy(&S->compact);
+    free(S);
+    *pS = NULL;
+}
+
+// ----- Access Functions -----
+
+// Returns true iff an object is stored under key.
+bool storeExists(Store S, const char *key) {
+    return storeSize(S, key) >= 0;
+}
+
+// Returns the size of the object under key, -1 if there is none.
+long storeSize(Store S, const char *key) {
+    pthread_mutex_lock(&S->lock);
+    Entry e = lookup(S, key);
+    long size = e != NULL ? (long) e->size : -1;
+    pthread_mutex_unlock(&S->lock);
+    return size;
+}
+
+// Reads up to len bytes of the object under key, starting at byte off.
+// Returns the number of bytes read, 0 past the end, -1 on error.
+ssize_t storeRead(Store S, const char *key, long off, void *buf, size_t len) {
+    pthread_mutex_lock(&S->lock);
+    Entry e = lookup(S, key);
+    if (e == NULL) {
+        pthread_mutex_unlock(&S->lock);
+        errno = ENOENT;
+        return -1;
+    }
+    uint64_t pos = off;
+    int i = 0;
+    while (i < e->n && pos >= e->ext[i].len) {
+        pos -= e->ext[i++].len;
+    }
+    if (i == e->n) {
+        pthread_mutex_unlock(&S->lock);
+        return 0;
+    }
+    Extent x = e->ext[i];
+    int fd = S->segs[x.seg].fd;
+    pthread_mutex_unlock(&S->lock);
+
+    if (len > x.len - pos) {
+        len = x.len - pos;
+    }
+    return pread(fd, buf, len, x.off + pos);
+}
+
+// ----- Manipulation Procedures -----
+
+static int begin(Store S, const char *key, int type) {
+    if (S->segs[S->active].size >= SEGMENT_MAX && roll(S) < 0) {
+        return -1;
+    }
+    Segment *g = &S->segs[S->active];
+    // the length is filled in on commit; until then the record runs past the
+    // end of the file, so a crash mid-write leaves a torn record
+    RecordHeader h = { RECORD_MAGIC, type, strlen(key), UINT64_MAX };
+    if (pwrite(g->fd, &h, sizeof h, g->size) != sizeof h
+        || pwrite(g->fd, key, h.keylen, g->size + sizeof h) != h.keylen
+        || lseek(g->fd, g->size + sizeof h + h.keylen, SEEK_SET) < 0) {
+        ftruncate(g->fd, g->size);
+        return -1;
+    }
+    S->pending = true;
+    S->pending_append = type == REC_APPEND;
+    strcpy(S->pending_key, key);
+    S->pending_off = g->size;
+    return g->fd;
+}
+
+static int commit(Store S) {
+    Segment *g = &S->segs[S->active];
+    size_t keylen = strlen(S->pending_key);
+    uint64_t off = S->pending_off + sizeof(RecordHeader) + keylen;
+    off_t end = lseek(g->fd, 0, SEEK_CUR);
+    int type = S->pending_append ? REC_APPEND : REC_PUT;
+    RecordHeader h = { RECORD_MAGIC, type, keylen, end - off };
+
+    S->pending = false;
+    if (end < (off_t) off || pwrite(g->fd, &h, sizeof h, S->pending_off) != sizeof h) {
+        ftruncate(g->fd, S->pending_off);
+        return -1;
+    }
+    g->size = end;
+    apply(S, S->pending_key, type, S->active, off, h.len);
+    footer_add(g, S->pending_key, type, off, h.len);
+    return 0;
+}
+
+// Starts writing the object under key, replacing it or appending to it.
+// The body is written to the returned file descriptor, then the write is
+// ended with storeCommit() or storeAbort(). Only one write may be in
+// progress. Returns -1 on error, with errno ENOENT when appending to a
+// missing object.
+int storeBegin(Store S, const char *key, bool append) {
+    if (strlen(key) == 0 || strlen(key) > KEY_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&S->lock);
+    if (append && lookup(S, key) == NULL) {
+        pthread_mutex_unlock(&S->lock);
+        errno = ENOENT;
+        return -1;
+    }
+    int fd = begin(S, key, append ? REC_APPEND : REC_PUT);
+    pthread_mutex_unlock(&S->lock);
+    return fd;
+}
+
+// Publishes the body written since storeBegin(). However many bytes were
+// written become the object's new content. Returns -1 on error.
+int storeCommit(Store S) {
+    pthread_mutex_lock(&S->lock);
+    int rc = commit(S);
+    pthread_mutex_unlock(&S->lock);
+    return rc;
+}
+
+// Drops the write started by storeBegin().
+void storeAbort(Store S) {
+    pthread_mutex_lock(&S->lock);
+    Segment *g = &S->segs[S->active];
+    if (S->pending) {
+        ftruncate(g->fd, S->pending_off);
+    }
+    S->pending = false;
+    pthread_mutex_unlock(&S->lock);
+}
+
+static void add_move(Store S, int *cap, Move m) {
+    if (S->nmoves == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        S->moves = realloc(S->moves, *cap * sizeof(Move));
+    }
+    S->moves[S->nmoves++] = m;
+}
+
+static int move_cmp(const void *a, const void *b) {
+    const Move *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+// Writes the moves into the compaction file, in their original order, and
+// seals it. Returns its size, 0 on error.
+static uint64_t rewrite(Store S, int src, int dst) {
+    Segment t = { .fd = dst };
+    char *buf = malloc(COPY_SIZE);
+    for (int m = 0; m < S->nmoves; m++) {
+        Move *mv = &S->moves[m];
+        RecordHeader h = { RECORD_MAGIC, mv->type, strlen(mv->e->key), mv->len };
+        if (write(dst, &h, sizeof h) != sizeof h || write(dst, mv->e->key, h.keylen) != h.keylen) {
+            break;
+        }
+        mv->new_off = t.size + sizeof h + h.keylen;
+        uint64_t done = 0;
+        while (done < mv->len) {
+            size_t n = mv->len - done < COPY_SIZE ? mv->len - done : COPY_SIZE;
+            ssize_t bytes = pread(src, buf, n, mv->off + done);
+            if (bytes <= 0 || write(dst, buf, bytes) != bytes) {
+                break;
+            }
+            done += bytes;
+        }
+        if (done < mv->len) {
+            break;
+        }
+        t.size = mv->new_off + mv->len;
+        footer_add(&t, mv->e->key, mv->type, mv->new_off, mv->len);
+    }
+    free(buf);
+    uint64_t body = t.size;
+    bool whole = t.count == (uint32_t) S->nmoves;
+    seal(&t);
+    if (!whole || t.size == body || fdatasync(dst) < 0) {
+        return 0;
+    }
+    return t.size;
+}
+
+// Picks the sealed segment with the most overwritten data and rewrites its
+// live records into a new file, while readers and writers carry on: the
+// segment is read-only, and objects overwritten meanwhile only leave a dead
+// record in the copy. Returns 1 if storeCompactCommit() should follow, 0 if
+// there is nothing to compact or the copy failed.
+int storeCompactBegin(Store S) {
+    pthread_mutex_lock(&S->compact);
+    pthread_mutex_lock(&S->lock);
+    int victim = -1;
+    double best = COMPACT_LIVE;
+    for (uint32_t i = 0; i < S->nsegs; i++) {
+        Segment *g = &S->segs[i];
+        if (g->fd >= 0 && g->sealed && !g->packed && i != S->active && g->size > 0
+            && (double) g->live / g->size < best) {
+            best = (double) g->live / g->size;
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        pthread_mutex_unlock(&S->lock);
+        pthread_mutex_unlock(&S->compact);
+        return 0;
+    }
+
+    // an extent is a PUT if it is where the object's last PUT is, else an
+    // APPEND; an empty last PUT has no extent and is moved on its own
+    int cap = 0;
+    S->nmoves = 0;
+    for (int b = 0; b < INDEX_BUCKETS; b++) {
+        for (Entry e = S->buckets[b]; e != NULL; e = e->next) {
+            bool put_here = e->put_seg == (uint32_t) victim;
+            if (put_here && (e->n == 0 || e->ext[0].seg != e->put_seg || e->ext[0].off != e->put_off)) {
+                add_move(S, &cap, (Move) { e, REC_PUT, e->put_off, 0, 0 });
+            }
+            for (int i = 0; i < e->n; i++) {
+                if (e->ext[i].seg == (uint32_t) victim) {
+                    int type = put_here && e->ext[i].off == e->put_off ? REC_PUT : REC_APPEND;
+                    add_move(S, &cap, (Move) { e, type, e->ext[i].off, e->ext[i].len, 0 });
+                }
+            }
+        }
+    }
+    int src = S->segs[victim].fd;
+    pthread_mutex_unlock(&S->lock);
+
+    S->victim = victim;
+    if (S->nmoves > 0) {
+        qsort(S->moves, S->nmoves, sizeof(Move), move_cmp);
+        char *tmp = compact_path(S);
+        S->compact_fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        S->compact_size = S->compact_fd >= 0 ? rewrite(S, src, S->compact_fd) : 0;
+        if (S->compact_size == 0) {
+            if (S->compact_fd >= 0) {
+                unlink(tmp);
+                close(S->compact_fd);
+            }
+            S->compact_fd = S->victim = -1;
+        }
+        free(tmp);
+    }
+    pthread_mutex_unlock(&S->compact);
+    return S->victim >= 0;
+}
+
+// Replaces the segment picked by storeCompactBegin() with its rewrite and
+// points the moved extents and PUTs at it, or deletes it if nothing in it was
+// live. The rewrite is only marked packed if every moved record is still
+// live, else the ones overwritten meanwhile are left for a later compaction.
+// The caller must keep readers and writers out while this runs, which only
+// takes a rename and a pass over the moved records.
+void storeCompactCommit(Store S) {
+    pthread_mutex_lock(&S->compact);
+    pthread_mutex_lock(&S->lock);
+    if (S->victim < 0) {
+        pthread_mutex_unlock(&S->lock);
+        pthread_mutex_unlock(&S->compact);
+        return;
+    }
+    Segment *g = &S->segs[S->victim];
+    char *path = segment_path(S, S->victim);
+    if (S->compact_fd < 0) {
+        unlink(path);
+        close(g->fd);
+        g->fd = -1;
+        g->size = g->live = 0;
+    } else {
+        char *tmp = compact_path(S);
+        if (rename(tmp, path) == 0) {
+            int live = 0;
+            for (int m = 0; m < S->nmoves; m++) {
+                Move *mv = &S->moves[m];
+                Entry e = mv->e;
+                bool found = false;
+                if (mv->type == REC_PUT && e->put_seg == (uint32_t) S->victim && e->put_off == mv->off) {
+                    e->put_off = mv->new_off;
+                    found = true;
+                }
+                for (int i = 0; mv->len > 0 && i < e->n; i++) {
+                    if (e->ext[i].seg == (uint32_t) S->victim && e->ext[i].off == mv->off) {
+                        e->ext[i].off = mv->new_off;
+                        found = true;
+                        break;
+                    }
+                }
+                live += found;
+            }
+            close(g->fd);
+            g->fd = S->compact_fd;
+            g->size = S->compact_size;
+            g->packed = live == S->nmoves;
+        } else {
+            unlink(tmp);
+            close(S->compact_fd);
+        }
+        free(tmp);
+    }
+    free(path);
+    S->compact_fd = S->victim = -1;
+    S->nmoves = 0;
+    pthread_mutex_unlock(&S->lock);
+    pthread_mutex_unlock(&S->compact);
+}
@@ -0,0 +1,27 @@
+/*********************************************************************************
+* Store.h
+* Log-Structured Object Store Header File
+*********************************************************************************/
+
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct StoreObj *Store;
+
+Store newStore(const char *dir);
+void freeStore(Store *pS);
+
+bool storeExists(Store S, const char *key);
+long storeSize(Store S, const char *key);
+ssize_t storeRead(Store S, const char *key, long off, void *buf, size_t len);
+
+int storeBegin(Store S, const char *key, bool append);
+int storeCommit(Store S);
+void storeAbort(Store S);
+int storeCompactBegin(Store S);
+void storeCompactCommit(Store S);
+
+#endif
@@ -0,0 +1,133 @@
+/*********************************************************************************
+* TimerWheel.c
+* Hierarchical Timer Wheel
+*********************************************************************************/
+
+#include "TimerWheel.h"
+
+#include <stdlib.h>
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+// ----- Structs -----
+
+// slots[0] holds timers due within WHEEL_SIZE ticks, each higher level covers
+// WHEEL_SIZE times the span of the one below it and cascades down into it.
+typedef struct TimerWheelObj {
+    TimerObj slots[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t current;
+} TimerWheelObj;
+
+// ----- Constructors - Destructors -----
+
+// Creates and returns a new empty TimerWheel whose clock starts at now.
+TimerWheel newTimerWheel(uint64_t now) {
+    TimerWheel W = malloc(sizeof(TimerWheelObj));
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            W->slots[l][i].next = W->slots[l][i].prev = &W->slots[l][i];
+        }
+    }
+    W->current = now;
+    return W;
+}
+
+// Frees all heap memory associated with *pW. Pending timers are dropped.
+void freeTimerWheel(TimerWheel *pW) {
+    if (pW == NULL || *pW == NULL) {
+        return;
+    }
+    free(*pW);
+    *pW = NULL;
+}
+
+// ----- Access Functions -----
+
+// Returns true iff t is waiting to fire.
+bool timerArmed(TimerObj *t) {
+    return t->next != NULL;
+}
+
+// ----- Manipulation Procedures -----
+
+// Sets up t to call fire(t, arg) once it expires.
+void timerInit(TimerObj *t, void (*fire)(TimerObj *t, void *arg), void *arg) {
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fire = fire;
+    t->arg = arg;
+}
+
+// Links t into the slot matching its distance from the wheel's clock.
+static void timerInsert(TimerWheel W, TimerObj *t) {
+    uint64_t expires = t->expires < W->current ? W->current : t->expires;
+    uint64_t delta = expires - W->current;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t) 1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))) {
+        expires = W->current + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    TimerObj *head = &W->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+// Arms t to fire at tick expires, replacing any earlier deadline.
+void timerSchedule(TimerWheel W, TimerObj *t, uint64_t expires) {
+    timerCancel(t);
+    t->expires = expires;
+    timerInsert(W, t);
+}
+
+// Disarms t. Does nothing if t is not armed.
+void timerCancel(TimerObj *t) {
+    if (t->next == NULL) {
+        return;
+    }
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+// Moves every timer in a higher level slot down to where it now belongs.
+static void timerCascade(TimerWheel W, int level) {
+    TimerObj *head = &W->slots[level][(W->current >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    TimerObj *t = head->next;
+
+    head->next = head->prev = head;
+    while (t != head) {
+        TimerObj *next = t->next;
+        timerInsert(W, t);
+        t = next;
+    }
+}
+
+// Runs the wheel's clock up to tick now, firing every timer that expires.
+// Callbacks may schedule timers, including the one that fired.
+void timerAdvance(TimerWheel W, uint64_t now) {
+    while (W->current <= now) {
+        if ((W->current & WHEEL_MASK) == 0) {
+            for (int l = 1; l < WHEEL_LEVELS; l++) {
+                timerCascade(W, l);
+                if (((W->current >> (WHEEL_BITS * l)) & WHEEL_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+        TimerObj *head = &W->slots[0][W->current & WHEEL_MASK];
+        while (head->next != head) {
+            TimerObj *t = head->next;
+            timerCancel(t);
+            t->fire(t, t->arg);
+        }
+        W->current++;
+    }
+}
@@ -0,0 +1,33 @@
+/*********************************************************************************
+* TimerWheel.h
+* Hierarchical Timer Wheel Header File
+*********************************************************************************/
+
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timers are embedded in the caller's own structs, so scheduling and
+// cancelling never allocate.
+typedef struct TimerObj {
+    struct TimerObj *next;
+    struct TimerObj *prev;
+    uint64_t expires;
+    void (*fire)(struct TimerObj *t, void *arg);
+    void *arg;
+} TimerObj;
+
+typedef struct TimerWheelObj *TimerWheel;
+
+TimerWheel newTimerWheel(uint64_t now);
+void freeTimerWheel(TimerWheel *pW);
+
+void timerInit(TimerObj *t, void (*fire)(TimerObj *t, void *arg), void *arg);
+bool timerArmed(TimerObj *t);
+void timerSchedule(TimerWheel W, TimerObj *t, uint64_t expires);
+void timerCancel(TimerObj *t);
+void timerAdvance(TimerWheel W, uint64_t now);
+
+#endif
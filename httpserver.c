@@ -1,25 +1,79 @@
+#define _GNU_SOURCE
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <pthread.h>
 #include <regex.h>
 #include <ctype.h>
+#include <time.h>
+#include "BufferPool.h"
+#include "Coroutine.h"
 #include "List.h"
+#include "RateLimit.h"
+#include "Store.h"
+#include "TimerWheel.h"
 
-#define OPTIONS              "t:l:"
+#define OPTIONS              "t:l:sgd:L:r:b:c:"
 #define BUF_SIZE             4096
+#define STATUS_SIZE          64
+#define WORKER_STACK         (256 * 1024)
 #define DEFAULT_THREAD_COUNT 4
+#define SMALL_FILE_MAX       (64 * 1024)
+#define MAP_CACHE_SIZE       256
+#define URI_MAX              32
+#define LARGE_FILE_MIN       (8 * 1024 * 1024)
+#define LARGE_CHUNK          (256 * 1024)
+#define LARGE_WINDOW         (4 * 1024 * 1024)
+#define PAGE_ALIGN           4096
+#define FLIGHT_MAX           LARGE_FILE_MIN
+#define FLIGHT_CHUNK         (64 * 1024)
+#define FLIGHT_BUDGET        (64 * 1024 * 1024)
+#define BATCH_MAX            256
+#define BATCH_BYTES_MAX      (32 * 1024 * 1024)
+
+#define TICK_MS            100
+#define HEADER_TIMEOUT_MS  10000
+#define BODY_IDLE_MS       10000
+#define REQUEST_TIMEOUT_MS 60000
+#define SEND_GRACE_MS      1000
+#define LINGER_MS          1000
+#define LINGER_MAX         (1024 * 1024)
+
+#define ACCEPT_BATCH  64
+#define SHARD_IDLE_MS 10
+#define GREEN_IDLE_MS 100
+
+#define COMPACT_INTERVAL_MS 1000
+
+#define LISTEN_SPECS       16
+#define LISTEN_MAX         1024
+#define LISTEN_BACKLOG     128
+#define LISTEN_FDS_ENV     "HTTPSERVER_LISTEN_FDS"
+#define UPGRADE_FD_ENV     "HTTPSERVER_UPGRADE_FD"
+#define UPGRADE_TIMEOUT_MS 10000
+#define DRAIN_TIMEOUT_MS   30000
 
 #define METHOD  "[a-zA-Z]{1,8}"
 #define URI     "/[a-zA-Z0-9_.]{1,19}"
@@ -28,25 +82,208 @@
 #define HEADER  "[[a-zA-Z0-9_.-]:[ ]+[0-9]+\r\n]*"
 
 static FILE *logfile;
+static regex_t regr, regc;
+
+// Set with -d: objects live in segment files of this store instead of one
+// file per URI.
+static Store store;
+
+// Set with -r, -b or -c: limits per client address, checked on accept.
+static RateLimit limiter;
 
 List queue;
 
 int flag = 0;
 int readers = 0, writers = 0;
 
+// A socket to listen on, from -L or the positional port. defer and fastopen
+// are 0 when off.
+struct ListenSpec {
+    int family;
+    uint16_t port;
+    char *path;
+    int backlog;
+    int nodelay;
+    int defer;
+    int fastopen;
+};
+
+static struct ListenSpec specs[LISTEN_SPECS];
+static int spec_count;
+
+// In sharded mode every worker is pinned to a core and owns a listener per
+// TCP spec (Unix sockets are shared) and its queue. Aligned so neighbouring
+// shards never share a cache line.
+struct Shard {
+    _Alignas(64) int nlisten;
+    int listenfd[LISTEN_SPECS];
+    int cpu;
+    List queue;
+    pthread_mutex_t lock;
+};
+
+static struct Shard *shards;
+static int shard_count;
+
+// Every socket this process accepts on, handed to the next process on SIGUSR2.
+static int listeners[LISTEN_MAX];
+static int listener_count;
+
+// Set when this process was started by upgrade(): the listeners to take over,
+// and the socket to report readiness on. The old process keeps its end open
+// until it exits.
+static int inherited[LISTEN_MAX];
+static int inherited_count, inherited_next;
+static int upgrade_fd = -1;
+static char **args;
+
+// In green mode main() counts queued connections here, so schedulers blocked
+// in epoll notice them.
+static int queue_event = -1;
+
 struct ThreadInfo {
     int count;
     pthread_t *dispatcher;
 } ThreadInfo;
 
 pthread_mutex_t lock, readwrite_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t notempty, reading, writing = PTHREAD_COND_INITIALIZER;
+// A condition OS threads wait on with pthread_cond_wait() and green threads
+// by parking on its wait list, so a waiting coroutine costs nothing until it
+// is woken.
+struct Cond {
+    pthread_cond_t cond;
+    CoWaitList green;
+};
+
+pthread_cond_t notempty = PTHREAD_COND_INITIALIZER;
+static struct Cond reading = { PTHREAD_COND_INITIALIZER, { NULL, NULL } };
+static struct Cond writing = { PTHREAD_COND_INITIALIZER, { NULL, NULL } };
+
+// Per-connection deadlines, indexed by connfd. The idle timer covers the wait
+// for the request header and then each gap in the body, the total timer the
+// whole request. slot is the client's rate limiter slot, and bytes what the
+// connection has sent and received, charged to it at the end.
+struct Conn {
+    int fd;
+    int expired;
+    TimerObj header;
+    TimerObj idle;
+    TimerObj total;
+    int slot;
+    long bytes;
+};
+
+static struct Conn *conns;
+static int conns_max;
+static TimerWheel wheel;
+pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Small file kept mapped between requests, so a GET is a single writev.
+struct MapEntry {
+    char uri[URI_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    char *addr;
+    int refs;
+};
+
+static struct MapEntry map_cache[MAP_CACHE_SIZE];
+pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One read of a file version, shared by every GET for it that arrives while
+// the read is in progress. The leader fills buf, followers send what is
+// filled so far and wait on cond for more.
+struct Flight {
+    char uri[URI_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *buf;
+    off_t filled;
+    int done;
+    int refs;
+    struct Cond cond;
+    struct Flight *next;
+};
+
+static struct Flight *flights;
+static long flight_bytes; // buffered by all flights, at most FLIGHT_BUDGET
+pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the constant status line for code.
+static const char *status_line(int code) {
+    switch (code) {
+    case 200: return "HTTP/1.1 200 OK\r\nContent-Length: ";
+    case 201: return "HTTP/1.1 201 Created\r\nContent-Length: ";
+    case 400: return "HTTP/1.1 400 Bad Request\r\nContent-Length: ";
+    case 403: return "HTTP/1.1 403 Forbidden\r\nContent-Length: ";
+    case 404: return "HTTP/1.1 404 Not Found\r\nContent-Length: ";
+    case 408: return "HTTP/1.1 408 Request Timeout\r\nContent-Length: ";
+    case 429: return "HTTP/1.1 429 Too Many Requests\r\nContent-Length: ";
+    case 501: return "HTTP/1.1 501 Not Implemented\r\nContent-Length: ";
+    default: return "HTTP/1.1 500 Internal Server Error\r\nContent-Length: ";
+    }
+}
+
+// Parks the calling green thread until connfd is ready. Returns -1 on an OS
+// thread, where sockets block and EAGAIN is a real error.
+static int conn_wait(int connfd, int events) {
+    if (!coActive()) {
+        return -1;
+    }
+    coWaitFd(connfd, events);
+    return 0;
+}
+
+// Writes every iovec to connfd, resuming after partial writes.
+// Returns 0 on success, -1 on error.
+static int send_iov(int connfd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t bytes = writev(connfd, iov, iovcnt);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && conn_wait(connfd, EPOLLOUT) == 0) {
+                continue;
+            }
+            return -1;
+        }
+        if (connfd < conns_max) {
+            conns[connfd].bytes += bytes;
+        }
+        while (iovcnt > 0 && (size_t) bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+    return 0;
+}
+
+// Sends all len bytes of buf to connfd. Returns len, or -1 on error.
+static ssize_t conn_send(int connfd, const void *buf, size_t len) {
+    struct iovec iov = { (void *) buf, len };
+    return send_iov(connfd, &iov, 1) == 0 ? (ssize_t) len : -1;
+}
 
 // Sends status message back to client.
 void send_status(char msg[], int connfd, int code, char content[]) {
-    sprintf(msg, "HTTP/1.1 %d %s\r\nContent-Length: %ld\r\n\r\n%s\n", code, content,
-        strlen(content) + 1, content);
-    send(connfd, msg, strlen(msg), 0);
+    const char *line = status_line(code);
+    int n = sprintf(msg, "%zu\r\n\r\n", strlen(content) + 1);
+    struct iovec iov[] = {
+        { (void *) line, strlen(line) },
+        { msg, n },
+        { content, strlen(content) },
+        { "\n", 1 },
+    };
+    send_iov(connfd, iov, 4);
 }
 
 void send_log(char *method, char *uri, int code, int request) {
@@ -54,6 +291,180 @@ void send_log(char *method, char *uri, int code, int request) {
     fflush(logfile);
 }
 
+static uint64_t now_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+// Fires when a deadline passes. Shutting down the read side wakes a blocked
+// recv so the worker can answer 408 and release its locks. If the worker is
+// instead stuck sending, the total timer comes back after SEND_GRACE_MS and
+// shuts down the write side too.
+static void conn_expire(TimerObj *t, void *arg) {
+    struct Conn *c = arg;
+    if (c->expired++ == 0) {
+        shutdown(c->fd, SHUT_RD);
+        timerSchedule(wheel, &c->total, now_ticks() + SEND_GRACE_MS / TICK_MS);
+    } else if (t == &c->total) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+static void conn_begin(int connfd) {
+    if (connfd >= conns_max) {
+        return;
+    }
+    struct Conn *c = &conns[connfd];
+    c->fd = connfd;
+    c->expired = 0;
+    c->bytes = 0;
+    timerInit(&c->header, conn_expire, c);
+    timerInit(&c->idle, conn_expire, c);
+    timerInit(&c->total, conn_expire, c);
+    pthread_mutex_lock(&timer_lock);
+    timerSchedule(wheel, &c->header, now_ticks() + HEADER_TIMEOUT_MS / TICK_MS);
+    timerSchedule(wheel, &c->total, now_ticks() + REQUEST_TIMEOUT_MS / TICK_MS);
+    pthread_mutex_unlock(&timer_lock);
+}
+
+// Stops the header deadline of connfd once its whole header has arrived.
+static void conn_header_done(int connfd) {
+    if (connfd >= conns_max) {
+        return;
+    }
+    pthread_mutex_lock(&timer_lock);
+    timerCancel(&conns[connfd].header);
+    pthread_mutex_unlock(&timer_lock);
+}
+
+static void conn_end(int connfd) {
+    if (connfd >= conns_max) {
+        return;
+    }
+    pthread_mutex_lock(&timer_lock);
+    timerCancel(&conns[connfd].header);
+    timerCancel(&conns[connfd].idle);
+    timerCancel(&conns[connfd].total);
+    pthread_mutex_unlock(&timer_lock);
+    if (limiter != NULL) {
+        rateDone(limiter, conns[connfd].slot, conns[connfd].bytes);
+    }
+}
+
+// Returns true iff a deadline of connfd has passed.
+static int conn_expired(int connfd) {
+    if (connfd >= conns_max) {
+        return 0;
+    }
+    pthread_mutex_lock(&timer_lock);
+    int expired = conns[connfd].expired;
+    pthread_mutex_unlock(&timer_lock);
+    return expired;
+}
+
+// recv() that gives up once the client has been idle for timeout_ms (0 for
+// no idle limit) or a deadline of the request has passed. Returns -1 with
+// errno ETIMEDOUT in that case.
+static ssize_t conn_recv(int connfd, void *buf, size_t len, int timeout_ms) {
+    if (connfd < conns_max && timeout_ms > 0) {
+        pthread_mutex_lock(&timer_lock);
+        timerSchedule(wheel, &conns[connfd].idle, now_ticks() + timeout_ms / TICK_MS);
+        pthread_mutex_unlock(&timer_lock);
+    }
+    ssize_t bytes;
+    while ((bytes = recv(connfd, buf, len, 0)) < 0) {
+        if (errno != EAGAIN || conn_wait(connfd, EPOLLIN) < 0) {
+            break;
+        }
+    }
+    if (connfd < conns_max) {
+        pthread_mutex_lock(&timer_lock);
+        timerCancel(&conns[connfd].idle);
+        pthread_mutex_unlock(&timer_lock);
+        if (bytes > 0) {
+            conns[connfd].bytes += bytes;
+        }
+    }
+    if (bytes <= 0 && conn_expired(connfd)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return bytes;
+}
+
+// Ticks the timer wheel.
+static void *timer_handler(void *arg) {
+    (void) arg;
+    struct timespec tick = { 0, TICK_MS * 1000000L };
+
+    for (;;) {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&timer_lock);
+        timerAdvance(wheel, now_ticks());
+        pthread_mutex_unlock(&timer_lock);
+    }
+    return NULL;
+}
+
+// Waits on c. A green thread must not block its OS thread, since the holder
+// may be another coroutine on it, so it parks on the wait list instead and
+// its scheduler runs the others until it is woken.
+static void lock_wait(struct Cond *c, pthread_mutex_t *mutex) {
+    if (coActive()) {
+        coWait(&c->green, mutex);
+    } else {
+        pthread_cond_wait(&c->cond, mutex);
+    }
+}
+
+// Wakes a waiter of c of each kind, as they cannot be told apart from here.
+// The caller holds the mutex c is waited on with.
+static void cond_signal(struct Cond *c) {
+    pthread_cond_signal(&c->cond);
+    coWakeOne(&c->green);
+}
+
+static void cond_broadcast(struct Cond *c) {
+    pthread_cond_broadcast(&c->cond);
+    coWakeAll(&c->green);
+}
+
+static void reader_acquire(void) {
+    pthread_mutex_lock(&readwrite_lock);
+    while (writers > 0) { // currently writing to file, so wait until done
+        lock_wait(&reading, &readwrite_lock);
+    }
+    readers += 1;
+    pthread_mutex_unlock(&readwrite_lock);
+}
+
+static void reader_release(void) {
+    pthread_mutex_lock(&readwrite_lock);
+    readers -= 1;
+    if (readers == 0) { // able to write since no more readers
+        cond_signal(&writing);
+    }
+    pthread_mutex_unlock(&readwrite_lock);
+}
+
+static void writer_acquire(void) {
+    pthread_mutex_lock(&readwrite_lock);
+    while (writers > 0 || readers > 0) { // allow one writer at a time
+        lock_wait(&writing, &readwrite_lock);
+    }
+    writers = 1;
+    pthread_mutex_unlock(&readwrite_lock);
+}
+
+static void writer_release(void) {
+    pthread_mutex_lock(&readwrite_lock);
+    writers = 0;
+    cond_signal(&writing);
+    cond_broadcast(&reading); // broadcast all threads because more than 1 readers
+    pthread_mutex_unlock(&readwrite_lock);
+}
+
 // Converts a string to an 16 bits unsigned integer.
 // Returns 0 if the string is malformed or out of the range.
 static size_t strtouint16(char number[]) {
@@ -65,30 +476,503 @@ static size_t strtouint16(char number[]) {
     return num;
 }
 
-// Creates a socket for listening for connections.
+// Parses a -L listener: "tcp:PORT", "tcp6:PORT" (also accepts IPv4) or
+// "unix:PATH", then comma-separated options "backlog=N", "nodelay",
+// "defer=SECONDS" and "fastopen=QUEUE". Exits on a bad spec.
+static void parse_listen(char *arg) {
+    if (spec_count == LISTEN_SPECS) {
+        errx(EXIT_FAILURE, "too many listeners");
+    }
+    struct ListenSpec *spec = &specs[spec_count++];
+    char *copy = strdup(arg), *save;
+    char *addr = strtok_r(copy, ",", &save);
+    spec->backlog = LISTEN_BACKLOG;
+    if (addr != NULL && strncmp(addr, "unix:", 5) == 0 && addr[5] != '\0') {
+        spec->family = AF_UNIX;
+        spec->path = addr + 5;
+        if (strlen(spec->path) >= sizeof ((struct sockaddr_un *) 0)->sun_path) {
+            errx(EXIT_FAILURE, "socket path too long: %s", spec->path);
+        }
+    } else if (addr != NULL && strncmp(addr, "tcp6:", 5) == 0) {
+        spec->family = AF_INET6;
+        spec->port = strtouint16(addr + 5);
+    } else if (addr != NULL && strncmp(addr, "tcp:", 4) == 0) {
+        spec->family = AF_INET;
+        spec->port = strtouint16(addr + 4);
+    }
+    if (spec->family == 0 || (spec->family != AF_UNIX && spec->port == 0)) {
+        errx(EXIT_FAILURE, "bad listener: %s", arg);
+    }
+
+    for (char *opt = strtok_r(NULL, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(opt, '=');
+        int n = value != NULL ? strtol(value + 1, NULL, 10) : 0;
+        if (strncmp(opt, "backlog=", 8) == 0 && n > 0) {
+            spec->backlog = n;
+        } else if (strcmp(opt, "nodelay") == 0 && spec->family != AF_UNIX) {
+            spec->nodelay = 1;
+        } else if (strncmp(opt, "defer=", 6) == 0 && n > 0 && spec->family != AF_UNIX) {
+            spec->defer = n;
+        } else if (strncmp(opt, "fastopen=", 9) == 0 && n > 0 && spec->family != AF_UNIX) {
+            spec->fastopen = n;
+        } else {
+            errx(EXIT_FAILURE, "bad listener option: %s", opt);
+        }
+    }
+}
+
+// Creates a socket for listening for connections. With reuseport, several
+// sockets may bind the same port and the kernel spreads connections over them.
 // Closes the program and prints an error message on error.
-static int create_listen_socket(uint16_t port) {
-    struct sockaddr_in addr;
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+static int create_listen_socket(struct ListenSpec *spec, int reuseport) {
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+        struct sockaddr_un un;
+    } addr;
+    socklen_t addrlen;
+    int listenfd = socket(spec->family, SOCK_STREAM, 0);
     if (listenfd < 0) {
         err(EXIT_FAILURE, "socket error");
     }
+    int on = 1, off = 0;
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+        err(EXIT_FAILURE, "setsockopt error");
+    }
     memset(&addr, 0, sizeof addr);
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htons(INADDR_ANY);
-    addr.sin_port = htons(port);
-    if (bind(listenfd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+    if (spec->family == AF_INET) {
+        addr.in.sin_family = AF_INET;
+        addr.in.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.in.sin_port = htons(spec->port);
+        addrlen = sizeof addr.in;
+    } else if (spec->family == AF_INET6) {
+        // dual-stack, so IPv4 clients reach it as mapped addresses
+        if (setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off) < 0) {
+            err(EXIT_FAILURE, "setsockopt error");
+        }
+        addr.in6.sin6_family = AF_INET6;
+        addr.in6.sin6_addr = in6addr_any;
+        addr.in6.sin6_port = htons(spec->port);
+        addrlen = sizeof addr.in6;
+    } else {
+        addr.un.sun_family = AF_UNIX;
+        strcpy(addr.un.sun_path, spec->path);
+        addrlen = sizeof addr.un;
+        // a socket file left behind by an earlier run would fail the bind, but
+        // one that a running server still answers on must not be taken over,
+        // so only a socket refusing connections is removed
+        struct stat st;
+        if (lstat(spec->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (probe < 0) {
+                err(EXIT_FAILURE, "socket error");
+            }
+            if (connect(probe, &addr.sa, addrlen) == 0) {
+                errx(EXIT_FAILURE, "%s: already in use", spec->path);
+            }
+            if (errno == ECONNREFUSED) {
+                unlink(spec->path);
+            }
+            close(probe);
+        }
+    }
+    if (bind(listenfd, &addr.sa, addrlen) < 0) {
         err(EXIT_FAILURE, "bind error");
     }
-    if (listen(listenfd, 128) < 0) {
+    // accepted sockets inherit TCP_NODELAY from the listener
+    if (spec->nodelay && setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on) < 0) {
+        err(EXIT_FAILURE, "setsockopt error");
+    }
+    if (spec->defer
+        && setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &spec->defer, sizeof spec->defer) < 0) {
+        err(EXIT_FAILURE, "setsockopt error");
+    }
+    if (spec->fastopen
+        && setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &spec->fastopen, sizeof spec->fastopen)
+               < 0) {
+        err(EXIT_FAILURE, "setsockopt error");
+    }
+    if (listen(listenfd, spec->backlog) < 0) {
         err(EXIT_FAILURE, "listen error");
     }
     return listenfd;
 }
 
+// Picks up the listeners and upgrade socket that the replaced process named
+// in the environment, and removes them from it.
+static void inherit_listeners(void) {
+    char *fds = getenv(LISTEN_FDS_ENV), *end;
+    while (fds != NULL && inherited_count < LISTEN_MAX) {
+        int fd = strtol(fds, &end, 10);
+        if (end == fds) {
+            break;
+        }
+        inherited[inherited_count++] = fd;
+        fds = *end == ',' ? end + 1 : end;
+    }
+    char *up = getenv(UPGRADE_FD_ENV);
+    if (up != NULL) {
+        upgrade_fd = strtol(up, NULL, 10);
+        fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+    }
+    unsetenv(LISTEN_FDS_ENV);
+    unsetenv(UPGRADE_FD_ENV);
+}
+
+// Returns the next inherited listener, or a new one for spec, as a
+// non-blocking socket.
+static int take_listener(struct ListenSpec *spec, int reuseport) {
+    int fd;
+    if (listener_count == LISTEN_MAX) {
+        errx(EXIT_FAILURE, "too many listeners");
+    }
+    if (inherited_next < inherited_count) {
+        fd = inherited[inherited_next++];
+    } else {
+        fd = create_listen_socket(spec, reuseport);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    listeners[listener_count++] = fd;
+    return fd;
+}
+
+// Tells the replaced process that we are listening, so it stops accepting.
+// The segment store cannot be shared, so in store mode this then waits until
+// that process has drained and exited.
+static void upgrade_ready(int wait_exit) {
+    while (inherited_next < inherited_count) {
+        close(inherited[inherited_next++]);
+    }
+    if (upgrade_fd < 0) {
+        return;
+    }
+    char c = 'R';
+    if (write(upgrade_fd, &c, 1) != 1) {
+        warn("upgrade: could not report ready");
+    }
+    while (wait_exit && read(upgrade_fd, &c, 1) > 0) {
+    }
+    close(upgrade_fd);
+    upgrade_fd = -1;
+}
+
+// Starts a new process from the same command line that takes over our
+// listeners, so connections in their backlogs are never refused. Returns 0
+// once it reports ready, -1 if it failed to start.
+static int upgrade(void) {
+    char fds[LISTEN_MAX * 12] = "";
+    for (int i = 0, n = 0; i < listener_count; i++) {
+        n += sprintf(fds + n, "%s%d", i ? "," : "", listeners[i]);
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        warn("upgrade: socketpair error");
+        return -1;
+    }
+    char listen_env[sizeof fds + 32], upgrade_env[48];
+    snprintf(listen_env, sizeof listen_env, LISTEN_FDS_ENV "=%s", fds);
+    snprintf(upgrade_env, sizeof upgrade_env, UPGRADE_FD_ENV "=%d", sv[1]);
+    int n = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    char **envp = malloc((n + 3) * sizeof(char *));
+    memcpy(envp, environ, n * sizeof(char *));
+    envp[n] = listen_env;
+    envp[n + 1] = upgrade_env;
+    envp[n + 2] = NULL;
+
+    fflush(stdout);
+    fflush(logfile);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // only async-signal-safe calls until exec: nothing but the listeners
+        // and the upgrade socket survives it
+        sigset_t none;
+        sigemptyset(&none);
+        pthread_sigmask(SIG_SETMASK, &none, NULL);
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+        for (int i = 0; i < listener_count; i++) {
+            fcntl(listeners[i], F_SETFD, 0);
+        }
+        fcntl(sv[1], F_SETFD, 0);
+        execvpe(args[0], args, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if (pid < 0) {
+        warn("upgrade: fork error");
+        close(sv[0]);
+        return -1;
+    }
+
+    char c;
+    struct pollfd pfd = { sv[0], POLLIN, 0 };
+    if (poll(&pfd, 1, UPGRADE_TIMEOUT_MS) <= 0 || read(sv[0], &c, 1) != 1) {
+        warnx("upgrade: new process did not start");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned map_slot(char *uri) {
+    unsigned h = 5381;
+    for (char *c = uri; *c; c++) {
+        h = h * 33 + (unsigned char) *c;
+    }
+    return h % MAP_CACHE_SIZE;
+}
+
+// Returns a mapping of the file open on fd, reusing the cached one if the
+// file has not been replaced or resized. NULL if the slot is in use.
+static struct MapEntry *map_acquire(char *uri, int fd, struct stat *fs) {
+    struct MapEntry *e = &map_cache[map_slot(uri)];
+
+    pthread_mutex_lock(&map_lock);
+    if (e->addr != NULL && strcmp(e->uri, uri) == 0 && e->dev == fs->st_dev
+        && e->ino == fs->st_ino && e->size == fs->st_size) {
+        e->refs += 1;
+        pthread_mutex_unlock(&map_lock);
+        return e;
+    }
+    if (e->refs > 0 || strlen(uri) >= URI_MAX) {
+        pthread_mutex_unlock(&map_lock);
+        return NULL;
+    }
+    if (e->addr != NULL) {
+        munmap(e->addr, e->size);
+        e->addr = NULL;
+    }
+    void *addr = mmap(NULL, fs->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        pthread_mutex_unlock(&map_lock);
+        return NULL;
+    }
+    strcpy(e->uri, uri);
+    e->dev = fs->st_dev;
+    e->ino = fs->st_ino;
+    e->size = fs->st_size;
+    e->addr = addr;
+    e->refs = 1;
+    pthread_mutex_unlock(&map_lock);
+    return e;
+}
+
+static void map_release(struct MapEntry *e) {
+    pthread_mutex_lock(&map_lock);
+    e->refs -= 1;
+    pthread_mutex_unlock(&map_lock);
+}
+
+// Drops the cached mapping of uri. Called by writers, so no reader holds it.
+static void map_invalidate(char *uri) {
+    struct MapEntry *e = &map_cache[map_slot(uri)];
+
+    pthread_mutex_lock(&map_lock);
+    if (e->addr != NULL && e->refs == 0 && strcmp(e->uri, uri) == 0) {
+        munmap(e->addr, e->size);
+        e->addr = NULL;
+    }
+    pthread_mutex_unlock(&map_lock);
+}
+
+// Sends a small file as header and mapped body in one writev.
+// Returns 0 when sent, -1 on a send error, 1 if the file could not be mapped.
+static int get_small(int connfd, int fd, char *uri, struct stat *fs) {
+    static const char ok[] = "HTTP/1.1 200 OK\r\nContent-Length: ";
+    char length[32];
+    int n = sprintf(length, "%ld\r\n\r\n", (long) fs->st_size);
+    struct iovec iov[] = {
+        { (void *) ok, sizeof ok - 1 },
+        { length, n },
+        { NULL, 0 },
+    };
+
+    if (fs->st_size == 0) {
+        return send_iov(connfd, iov, 2);
+    }
+    struct MapEntry *e = map_acquire(uri, fd, fs);
+    if (e == NULL) {
+        return 1;
+    }
+    iov[2].iov_base = e->addr;
+    iov[2].iov_len = e->size;
+    int rc = send_iov(connfd, iov, 3);
+    map_release(e);
+    return rc;
+}
+
+// Joins the in-progress read of this version of uri, or starts one.
+// Sets *leader when the caller has to do the reading. Returns NULL if a new
+// buffer would go over FLIGHT_BUDGET or cannot be allocated.
+static struct Flight *flight_join(char *uri, struct stat *fs, int *leader) {
+    pthread_mutex_lock(&flight_lock);
+    for (struct Flight *f = flights; f != NULL; f = f->next) {
+        if (strcmp(f->uri, uri) == 0 && f->dev == fs->st_dev && f->ino == fs->st_ino
+            && f->size == fs->st_size && f->mtime.tv_sec == fs->st_mtim.tv_sec
+            && f->mtime.tv_nsec == fs->st_mtim.tv_nsec) {
+            f->refs += 1;
+            pthread_mutex_unlock(&flight_lock);
+            *leader = 0;
+            return f;
+        }
+    }
+    struct Flight *f = NULL;
+    if (flight_bytes + fs->st_size <= FLIGHT_BUDGET) {
+        f = calloc(1, sizeof(struct Flight));
+    }
+    if (f != NULL && (f->buf = malloc(fs->st_size)) == NULL) {
+        free(f);
+        f = NULL;
+    }
+    if (f == NULL) {
+        pthread_mutex_unlock(&flight_lock);
+        return NULL;
+    }
+    flight_bytes += fs->st_size;
+    strcpy(f->uri, uri);
+    f->dev = fs->st_dev;
+    f->ino = fs->st_ino;
+    f->size = fs->st_size;
+    f->mtime = fs->st_mtim;
+    f->refs = 1;
+    pthread_cond_init(&f->cond.cond, NULL);
+    f->next = flights;
+    flights = f;
+    pthread_mutex_unlock(&flight_lock);
+    *leader = 1;
+    return f;
+}
+
+// Publishes progress of the leader. Once done, later GETs start a new read.
+static void flight_fill(struct Flight *f, off_t filled, int done) {
+    pthread_mutex_lock(&flight_lock);
+    f->filled = filled;
+    f->done = done;
+    if (done != 0) {
+        for (struct Flight **p = &flights; *p != NULL; p = &(*p)->next) {
+            if (*p == f) {
+                *p = f->next;
+                break;
+            }
+        }
+    }
+    cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&flight_lock);
+}
+
+static void flight_leave(struct Flight *f) {
+    pthread_mutex_lock(&flight_lock);
+    int last = --f->refs == 0;
+    if (last) {
+        flight_bytes -= f->size;
+    }
+    pthread_mutex_unlock(&flight_lock);
+    if (last) {
+        pthread_cond_destroy(&f->cond.cond);
+        free(f->buf);
+        free(f);
+    }
+}
+
+// Sends a file no larger than FLIGHT_MAX, reading it from disk only once for
+// all concurrent GETs of the same version. Returns 0 when sent, -1 on a send
+// or read error, 1 if there is no buffer for it and the caller is to stream
+// the file instead.
+static int get_shared(int connfd, int fd, char *uri, struct stat *fs) {
+    char msg[64];
+    int leader;
+    struct Flight *f = flight_join(uri, fs, &leader);
+    if (f == NULL) {
+        return 1;
+    }
+
+    if (leader) {
+        // fill the whole buffer before sending anything, so neither a slow
+        // client of ours nor one that went away holds up the followers
+        off_t filled = 0;
+        int done = 0;
+        while (done == 0) {
+            size_t want = f->size - filled < FLIGHT_CHUNK ? f->size - filled : FLIGHT_CHUNK;
+            ssize_t bytes = want > 0 ? read(fd, f->buf + filled, want) : 0;
+            if (bytes > 0) {
+                filled += bytes;
+            }
+            done = bytes < 0 || (bytes == 0 && filled < f->size) ? -1 : filled == f->size;
+            flight_fill(f, filled, done);
+        }
+    }
+
+    // everyone, the leader included, sends from the buffer at its own pace
+    sprintf(msg, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", (long) fs->st_size);
+    int rc = conn_send(connfd, msg, strlen(msg)) < 0 ? -1 : 0;
+    off_t sent = 0;
+    while (rc == 0) {
+        pthread_mutex_lock(&flight_lock);
+        while (f->filled == sent && f->done == 0) {
+            lock_wait(&f->cond, &flight_lock);
+        }
+        off_t filled = f->filled;
+        int done = f->done;
+        pthread_mutex_unlock(&flight_lock);
+        if (filled > sent) {
+            rc = conn_send(connfd, f->buf + sent, filled - sent) < 0 ? -1 : 0;
+            sent = filled;
+        } else {
+            rc = done < 0 ? -1 : 0;
+            break;
+        }
+    }
+    flight_leave(f);
+    return rc;
+}
+
+// Sends a file of at least LARGE_FILE_MIN without letting it crowd hot files
+// out of the page cache: reads ahead explicitly and drops what was sent.
+// Returns 0 when sent, -1 on error.
+static int get_large(int connfd, int fd, struct stat *fs) {
+    char msg[64];
+    char *buffer = malloc(LARGE_CHUNK);
+    if (buffer == NULL) {
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    readahead(fd, 0, LARGE_WINDOW);
+
+    sprintf(msg, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", (long) fs->st_size);
+    int rc = conn_send(connfd, msg, strlen(msg)) < 0 ? -1 : 0;
+    off_t off = 0, ahead = LARGE_WINDOW, dropped = 0;
+    ssize_t bytes = 0;
+
+    while (rc == 0 && (bytes = read(fd, buffer, LARGE_CHUNK)) > 0) {
+        off += bytes;
+        if (off + LARGE_WINDOW / 2 > ahead) {
+            readahead(fd, ahead, LARGE_WINDOW);
+            ahead += LARGE_WINDOW;
+        }
+        rc = conn_send(connfd, buffer, bytes) < 0 ? -1 : 0;
+        if (off - dropped >= LARGE_WINDOW) {
+            posix_fadvise(fd, dropped, off - dropped, POSIX_FADV_DONTNEED);
+            dropped = off;
+        }
+    }
+    free(buffer);
+    return bytes < 0 ? -1 : rc;
+}
+
+// Returns the status code of a GET whose open failed with err.
+static int open_status(int err) {
+    return err == EACCES || err == EISDIR ? 403 : err == ENOENT ? 404 : 500;
+}
+
 void get_handler(int connfd, char *uri, int request) {
     int fd = open(uri, O_RDONLY);
-    char msg[BUF_SIZE] = { 0 };
+    char msg[STATUS_SIZE];
 
     struct stat fs;
     stat(uri, &fs);
@@ -98,44 +982,113 @@ void get_handler(int connfd, char *uri, int request) {
         return;
     }
 
+    if (fd > 0 && S_ISREG(fs.st_mode) && fs.st_size <= SMALL_FILE_MAX) {
+        int rc = get_small(connfd, fd, uri, &fs);
+        if (rc != 1) {
+            send_log("GET", uri, rc == 0 ? 200 : 500, request);
+            close(fd);
+            return;
+        }
+    }
+
+    if (fd > 0 && S_ISREG(fs.st_mode) && fs.st_size <= FLIGHT_MAX) {
+        int rc = get_shared(connfd, fd, uri, &fs);
+        if (rc != 1) {
+            send_log("GET", uri, rc == 0 ? 200 : 500, request);
+            close(fd);
+            return;
+        }
+    }
+
+    if (fd > 0 && S_ISREG(fs.st_mode) && fs.st_size >= LARGE_FILE_MIN) {
+        int rc = get_large(connfd, fd, &fs);
+        send_log("GET", uri, rc == 0 ? 200 : 500, request);
+        close(fd);
+        return;
+    }
+
     if (fd > 0) {
         int size = fs.st_size;
         sprintf(msg, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", size);
-        send(connfd, msg, strlen(msg), 0);
+        conn_send(connfd, msg, strlen(msg));
 
-        char buffer[BUF_SIZE] = { 0 };
+        char *buffer = bufferGet(BUF_SIZE);
         ssize_t bytes = 0, curr_write = 0;
 
         while ((bytes = read(fd, buffer, BUF_SIZE)) > 0) {
-            curr_write = send(connfd, buffer, bytes, 0);
+            curr_write = conn_send(connfd, buffer, bytes);
             if (curr_write < 0) {
                 send_status(msg, connfd, 500, "Internal Server Error");
                 send_log("GET", uri, 500, request);
+                bufferPut(buffer);
                 close(fd);
                 return;
             }
         }
+        bufferPut(buffer);
         send_log("GET", uri, 200, request);
 
     } else {
-        if (errno == ENOENT) {
-            send_status(msg, connfd, 404, "Not Found");
-            send_log("GET", uri, 404, request);
-        } else {
-            send_status(msg, connfd, 500, "Internal Server Error");
-            send_log("GET", uri, 500, request);
-        }
+        int code = open_status(errno);
+        send_status(msg, connfd, code,
+            code == 404 ? "Not Found" : code == 403 ? "Forbidden" : "Internal Server Error");
+        send_log("GET", uri, code, request);
     }
     close(fd);
 }
 
-// Reads in from connfd and writes to file fd.
-int file_write(int connfd, int fd, char buffer[], long len, int bytes_init) {
-    int bytes_read = bytes_init, bytes = 0, curr_write = 0;
-    char msg[BUF_SIZE] = { 0 };
+// Write-behind state of a large upload: [prev, cur) is being written back,
+// [cur, end) is still only in the page cache.
+struct DropBehind {
+    off_t prev;
+    off_t cur;
+};
+
+// Starts writeback of each LARGE_WINDOW written to fd, then waits for the one
+// before it and drops it from the page cache, so a bulk upload only ever holds
+// about two windows of cache instead of evicting the hot working set.
+static void drop_behind(struct DropBehind *db, int fd) {
+    off_t end = lseek(fd, 0, SEEK_CUR);
+    if (end - db->cur < LARGE_WINDOW) {
+        return;
+    }
+    sync_file_range(fd, db->cur, end - db->cur, SYNC_FILE_RANGE_WRITE);
+    if (db->cur > db->prev) {
+        sync_file_range(fd, db->prev, db->cur - db->prev,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, db->prev, db->cur - db->prev, POSIX_FADV_DONTNEED);
+    }
+    db->prev = db->cur;
+    db->cur = end;
+}
+
+// Reads in from connfd and writes to file fd. Bodies of at least
+// LARGE_FILE_MIN go through a page-aligned buffer with write-behind.
+int file_write(int connfd, int fd, long len, int bytes_init) {
+    long bytes_read = bytes_init;
+    int bytes = 0, curr_write = 0, code = 200;
+    size_t chunk = BUF_SIZE;
+    char msg[STATUS_SIZE];
+    char *buffer, *large = NULL;
+    struct DropBehind db = { 0, 0 };
+
+    if (len >= LARGE_FILE_MIN && posix_memalign((void **) &large, PAGE_ALIGN, LARGE_CHUNK) == 0) {
+        buffer = large;
+        chunk = LARGE_CHUNK;
+        // an O_APPEND fd is still at 0 before its first write, and a window
+        // from 0 would drop the whole existing file from the cache
+        db.prev = db.cur = lseek(fd, 0, fcntl(fd, F_GETFL) & O_APPEND ? SEEK_END : SEEK_CUR);
+    } else {
+        buffer = bufferGet(BUF_SIZE);
+    }
 
     while (bytes_read < len) {
-        bytes = recv(connfd, buffer, BUF_SIZE, 0);
+        bytes = conn_recv(connfd, buffer, chunk, BODY_IDLE_MS);
+        if (bytes < 0 && errno == ETIMEDOUT) {
+            send_status(msg, connfd, 408, "Request Timeout");
+            code = 408;
+            break;
+        }
         if (bytes <= 0) {
             break;
         }
@@ -146,19 +1099,28 @@ int file_write(int connfd, int fd, char buffer[], long len, int bytes_init) {
         }
         if (curr_write <= 0) {
             send_status(msg, connfd, 500, "Internal Server Error");
-            return 500;
+            code = 500;
+            break;
         }
         bytes_read += bytes;
+        if (large != NULL) {
+            drop_behind(&db, fd);
+        }
     }
-    return 200;
+    if (large != NULL) {
+        free(large);
+    } else {
+        bufferPut(buffer);
+    }
+    return code;
 }
 
 void put_handler(int connfd, char *uri, char *length, char *msgBuf, int msgBufLen, int request) {
     // check if file does not exist, then send CREATED instead of OK
-    char msg[BUF_SIZE] = { 0 };
-    char buffer[BUF_SIZE] = { 0 };
+    char msg[STATUS_SIZE];
     long len = strtol(length, NULL, 0);
 
+    map_invalidate(uri);
     if (access(uri, F_OK) == -1) { // from delftstack.com
         int fd = open(uri, O_CREAT | O_WRONLY | O_TRUNC, 0622);
         if (msgBufLen > 0) {
@@ -175,9 +1137,10 @@ void put_handler(int connfd, char *uri, char *length, char *msgBuf, int msgBufLe
 
         int bytes_read = 0;
         bytes_read += msgBufLen;
-        if (file_write(connfd, fd, buffer, len, bytes_read) == 500) {
+        int code = file_write(connfd, fd, len, bytes_read);
+        if (code != 200) {
             close(fd);
-            send_log("PUT", uri, 500, request);
+            send_log("PUT", uri, code, request);
             return;
         }
 
@@ -210,9 +1173,10 @@ void put_handler(int connfd, char *uri, char *length, char *msgBuf, int msgBufLe
 
     int bytes_read = 0;
     bytes_read += msgBufLen;
-    if (file_write(connfd, fd, buffer, len, bytes_read) == 500) {
+    int code = file_write(connfd, fd, len, bytes_read);
+    if (code != 200) {
         close(fd);
-        send_log("PUT", uri, 500, request);
+        send_log("PUT", uri, code, request);
         return;
     }
 
@@ -222,10 +1186,10 @@ void put_handler(int connfd, char *uri, char *length, char *msgBuf, int msgBufLe
 }
 
 void append_handler(int connfd, char *uri, char *length, char *msgBuf, int msgBufLen, int request) {
-    char msg[BUF_SIZE] = { 0 };
-    char buffer[BUF_SIZE] = { 0 };
+    char msg[STATUS_SIZE];
     long len = strtol(length, NULL, 0);
 
+    map_invalidate(uri);
     int fd = open(uri, O_APPEND | O_WRONLY);
     if (errno == ENOENT && (fd < 0)) {
         send_status(msg, connfd, 404, "Not Found");
@@ -254,9 +1218,10 @@ void append_handler(int connfd, char *uri, char *length, char *msgBuf, int msgBu
 
     int bytes_read = 0;
     bytes_read += msgBufLen;
-    if (file_write(connfd, fd, buffer, len, bytes_read) == 500) {
+    int code = file_write(connfd, fd, len, bytes_read);
+    if (code != 200) {
         close(fd);
-        send_log("APPEND", uri, 500, request);
+        send_log("APPEND", uri, code, request);
         return;
     }
 
@@ -265,172 +1230,759 @@ void append_handler(int connfd, char *uri, char *length, char *msgBuf, int msgBu
     send_log("APPEND", uri, 200, request);
 }
 
-static void *handle_connection(int connfd) {
-    char buffer[BUF_SIZE] = { 0 };
-    char method[BUF_SIZE] = { 0 };
-    char uri[BUF_SIZE] = { 0 };
-    char version[BUF_SIZE] = { 0 };
-    char msg[BUF_SIZE] = { 0 };
-    char length[BUF_SIZE] = { 0 };
-    regex_t regr, regc;
-
-    if (regcomp(&regr, REQUEST, REG_EXTENDED)) {
-        printf("Failed to compile regex.\n");
-        return NULL;
+// GET from the segment store.
+static void store_get(int connfd, char *uri, int request) {
+    char msg[STATUS_SIZE];
+
+    long size = storeSize(store, uri);
+    if (size < 0) {
+        send_status(msg, connfd, 404, "Not Found");
+        send_log("GET", uri, 404, request);
+        return;
     }
-    if (regcomp(&regc, HEADER, REG_EXTENDED)) {
-        printf("Failed to compile regex.\n");
-        return NULL;
+    sprintf(msg, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", size);
+    if (conn_send(connfd, msg, strlen(msg)) < 0) {
+        send_log("GET", uri, 500, request);
+        return;
     }
-
-    size_t bytes_read = recv(connfd, buffer, BUF_SIZE - 1, 0);
-    if (regexec(&regr, buffer, 0, NULL, 0) == REG_NOMATCH) {
-        send_status(msg, connfd, 400, "Bad Request");
-        regfree(&regr);
-        regfree(&regc);
-        return NULL;
+    char *buffer = bufferGet(BUF_SIZE);
+    for (long off = 0; off < size;) {
+        ssize_t bytes = storeRead(store, uri, off, buffer, BUF_SIZE);
+        if (bytes <= 0 || conn_send(connfd, buffer, bytes) < 0) {
+            send_log("GET", uri, 500, request);
+            bufferPut(buffer);
+            return;
+        }
+        off += bytes;
     }
-    sscanf(buffer, "%s %s %s ", method, uri, version);
-    memmove(uri, uri + 1, strlen(uri)); // delete "/" in front
+    bufferPut(buffer);
+    send_log("GET", uri, 200, request);
+}
+
+// One item of a BATCH response: its frame line and its content, which is a
+// map_cache entry, a mapping of its own or (in store mode) a heap copy.
+struct BatchItem {
+    char line[64];
+    int code;
+    long size;
+    char *body;
+    struct MapEntry *e;
+    int mapped;
+};
+
+static int valid_uri(char *uri) {
+    size_t n = strlen(uri);
+    for (size_t i = 0; i < n; i++) {
+        if (!isalnum((unsigned char) uri[i]) && uri[i] != '_' && uri[i] != '.') {
+            return 0;
+        }
+    }
+    return n > 0 && n < 20;
+}
+
+// Loads the content of uri into it, if it fits in the room left in the
+// response. Returns the item's status code.
+static int batch_load(struct BatchItem *it, char *uri, long room) {
+    if (!valid_uri(uri)) {
+        return 400;
+    }
+    if (store != NULL) {
+        long size = storeSize(store, uri);
+        if (size < 0) {
+            return 404;
+        }
+        if (size > room) {
+            return 413;
+        }
+        it->body = malloc(size > 0 ? size : 1);
+        for (long off = 0; off < size;) {
+            ssize_t bytes = storeRead(store, uri, off, it->body + off, size - off);
+            if (bytes <= 0) {
+                free(it->body);
+                it->body = NULL;
+                return 500;
+            }
+            off += bytes;
+        }
+        it->size = size;
+        return 200;
+    }
+
+    int fd = open(uri, O_RDONLY);
+    if (fd < 0) {
+        return open_status(errno);
+    }
+    struct stat fs;
+    int code = fstat(fd, &fs) < 0 ? 500 : !S_ISREG(fs.st_mode) ? 403 : fs.st_size > room ? 413 : 0;
+    if (code != 0) {
+        close(fd);
+        return code;
+    }
+    it->size = fs.st_size;
+    if (fs.st_size > 0 && fs.st_size <= SMALL_FILE_MAX) {
+        it->e = map_acquire(uri, fd, &fs);
+    }
+    if (it->e != NULL) {
+        it->body = it->e->addr;
+    } else if (fs.st_size > 0) {
+        it->body = mmap(NULL, fs.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (it->body == MAP_FAILED) {
+            it->body = NULL;
+            close(fd);
+            return 500;
+        }
+        it->mapped = 1;
+    }
+    close(fd);
+    return 200;
+}
+
+// Answers a BATCH request, whose body lists up to BATCH_MAX URIs separated by
+// whitespace. The response body frames each item as "<code> <length> /<uri>",
+// CRLF, the content and CRLF, in request order. All items are read under one
+// reader lock, so they are consistent with each other, and sent in one writev.
+// Items past BATCH_BYTES_MAX of content in all are left out with 413. Every
+// other item with a well-formed URI is logged as a GET.
+static void batch_handler(int connfd, char *length, char *msgBuf, int msgBufLen, int request) {
+    char msg[STATUS_SIZE];
+    long len = strtol(length, NULL, 0);
+    if (len < 0 || len >= BUFFER_MAX) {
+        send_status(msg, connfd, 400, "Bad Request");
+        return;
+    }
+
+    char *list = bufferGet(len + 1);
+    long got = len <= msgBufLen ? len : msgBufLen;
+    memcpy(list, msgBuf, got);
+    while (got < len) {
+        ssize_t bytes = conn_recv(connfd, list + got, len - got, BODY_IDLE_MS);
+        if (bytes < 0 && errno == ETIMEDOUT) {
+            send_status(msg, connfd, 408, "Request Timeout");
+        }
+        if (bytes <= 0) {
+            bufferPut(list);
+            return;
+        }
+        got += bytes;
+    }
+    list[len] = '\0';
+
+    char *uris[BATCH_MAX];
+    int count = 0;
+    char *save;
+    for (char *u = strtok_r(list, " \t\r\n", &save); u != NULL; u = strtok_r(NULL, " \t\r\n", &save)) {
+        if (count == BATCH_MAX) {
+            send_status(msg, connfd, 400, "Bad Request");
+            bufferPut(list);
+            return;
+        }
+        uris[count++] = u[0] == '/' ? u + 1 : u;
+    }
+
+    struct BatchItem *items = calloc(count + 1, sizeof(struct BatchItem));
+    struct iovec *iov = malloc((3 * count + 1) * sizeof(struct iovec));
+    long total = 0, room = BATCH_BYTES_MAX;
+
+    reader_acquire();
+    for (int i = 0; i < count; i++) {
+        struct BatchItem *it = &items[i];
+        it->code = batch_load(it, uris[i], room);
+        if (it->code != 200) {
+            it->size = 0;
+        }
+        room -= it->size;
+        int n = snprintf(it->line, sizeof it->line, "%d %ld /%.32s\r\n", it->code, it->size, uris[i]);
+        iov[3 * i + 1] = (struct iovec) { it->line, n };
+        iov[3 * i + 2] = (struct iovec) { it->body, it->size };
+        iov[3 * i + 3] = (struct iovec) { "\r\n", 2 };
+        total += n + it->size + 2;
+    }
+    int n = sprintf(msg, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", total);
+    iov[0] = (struct iovec) { msg, n };
+    int rc = send_iov(connfd, iov, 3 * count + 1);
+    for (int i = 0; i < count; i++) {
+        if (items[i].e != NULL) {
+            map_release(items[i].e);
+        } else if (items[i].mapped) {
+            munmap(items[i].body, items[i].size);
+        } else {
+            free(items[i].body);
+        }
+    }
+    reader_release();
+
+    for (int i = 0; i < count; i++) {
+        // a malformed URI could break the log's format, and GET does not log
+        // a 400 either; a 413 is not what a GET of the item would get
+        if (items[i].code != 400 && items[i].code != 413) {
+            send_log("GET", uris[i], rc == 0 ? items[i].code : 500, request);
+        }
+    }
+    free(iov);
+    free(items);
+    bufferPut(list);
+}
+
+// PUT or APPEND into the segment store, with the same status codes as the
+// file handlers.
+static void store_write(
+    int connfd, char *uri, char *length, char *msgBuf, int msgBufLen, int request, int append) {
+    char *method = append ? "APPEND" : "PUT";
+    char msg[STATUS_SIZE];
+    long len = strtol(length, NULL, 0);
+
+    int code = append || storeExists(store, uri) ? 200 : 201;
+    int fd = storeBegin(store, uri, append);
+    if (fd < 0) {
+        code = errno == ENOENT ? 404 : 500;
+        send_status(msg, connfd, code, code == 404 ? "Not Found" : "Internal Server Error");
+        send_log(method, uri, code, request);
+        return;
+    }
+    if (msgBufLen > 0) {
+        write(fd, msgBuf, len <= msgBufLen ? len : msgBufLen);
+    }
+    if (len > msgBufLen) {
+        int rc = file_write(connfd, fd, len, msgBufLen);
+        if (rc != 200) {
+            storeAbort(store);
+            send_log(method, uri, rc, request);
+            return;
+        }
+    }
+    if (storeCommit(store) < 0) {
+        code = 500;
+    }
+    send_status(
+        msg, connfd, code, code == 201 ? "Created" : code == 200 ? "OK" : "Internal Server Error");
+    send_log(method, uri, code, request);
+}
+
+// Compacts the store in the background. The copy runs alongside readers and
+// writers; only the swap into the index runs as a writer.
+static void *compact_handler(void *arg) {
+    (void) arg;
+    struct timespec interval = { COMPACT_INTERVAL_MS / 1000, COMPACT_INTERVAL_MS % 1000 * 1000000L };
+
+    for (;;) {
+        nanosleep(&interval, NULL);
+        if (storeCompactBegin(store)) {
+            writer_acquire();
+            storeCompactCommit(store);
+            writer_release();
+        }
+    }
+    return NULL;
+}
+
+// Returns 0 if a PUT or APPEND of uri would be accepted, else the status
+// code it would be rejected with.
+static int upload_check(char *uri, int append) {
+    if (store != NULL) {
+        return append && !storeExists(store, uri) ? 404 : 0;
+    }
+    struct stat fs;
+    if (stat(uri, &fs) < 0) {
+        return errno != ENOENT ? 403 : append ? 404 : 0;
+    }
+    if (S_ISDIR(fs.st_mode) || access(uri, W_OK) < 0) {
+        return 403;
+    }
+    return 0;
+}
+
+// Ends the response on connfd and reads away what the client is still
+// sending, for at most LINGER_MS and LINGER_MAX bytes, so that close does not
+// reset the connection and discard the response before it is read.
+static void linger(int connfd) {
+    shutdown(connfd, SHUT_WR);
+    char *buffer = bufferGet(BUF_SIZE);
+    uint64_t deadline = now_ticks() + LINGER_MS / TICK_MS;
+    long drained = 0;
+    for (uint64_t now = now_ticks(); now < deadline && drained < LINGER_MAX; now = now_ticks()) {
+        ssize_t bytes = conn_recv(connfd, buffer, BUF_SIZE, (deadline - now) * TICK_MS);
+        if (bytes <= 0) {
+            break;
+        }
+        drained += bytes;
+    }
+    bufferPut(buffer);
+}
+
+// Answers "Expect: 100-continue" before the client sends the body. Returns 0
+// if there is no such header or the client was told to go on, -1 if that
+// failed, or the status code the upload is to be rejected with, which the
+// caller sends with expect_reject() once it has dropped the writer lock.
+static int expect_continue(int connfd, char *buffer, char *method, char *uri) {
+    static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    char *end = strstr(buffer, "\r\n\r\n");
+    char *e = strcasestr(buffer, "\r\nExpect:");
+    if (e == NULL || e >= end || strncasecmp(e + 9 + strspn(e + 9, " "), "100-continue", 12) != 0) {
+        return 0;
+    }
+
+    int code = upload_check(uri, strcmp(method, "APPEND") == 0);
+    if (code == 0) {
+        return conn_send(connfd, go_on, sizeof go_on - 1) < 0 ? -1 : 0;
+    }
+    return code;
+}
+
+// Sends the final status of an upload rejected by expect_continue() and
+// lingers, without holding any lock.
+static void expect_reject(int connfd, int code, char *method, char *uri, int request) {
+    char msg[STATUS_SIZE];
+    send_status(msg, connfd, code, code == 404 ? "Not Found" : "Forbidden");
+    if (code == 404) {
+        send_log(method, uri, code, request);
+    }
+    linger(connfd);
+}
+
+// Receives into buffer until the end of the request header, growing buffer
+// as needed, and sets *header to the length of the header including its
+// blank line. Returns the number of bytes received, which may include the
+// start of the body, 0 if the header never ended or contains a NUL (the
+// parser works on C strings), -1 on a timeout.
+static ssize_t recv_header(int connfd, char **buffer, size_t *header) {
+    size_t used = 0;
+
+    for (;;) {
+        if (used == bufferSize(*buffer) - 1) {
+            char *bigger = bufferGrow(*buffer, used);
+            if (bigger == NULL) {
+                return 0;
+            }
+            *buffer = bigger;
+        }
+        // bounded by the header deadline armed in conn_begin, not per recv,
+        // so trickling a byte at a time does not hold a worker for longer
+        ssize_t bytes = conn_recv(connfd, *buffer + used, bufferSize(*buffer) - 1 - used, 0);
+        if (bytes < 0 && errno == ETIMEDOUT) {
+            return -1;
+        }
+        if (bytes <= 0) {
+            return 0;
+        }
+        size_t from = used < 3 ? 0 : used - 3;
+        used += bytes;
+        (*buffer)[used] = '\0';
+        char *end = memmem(*buffer + from, used - from, "\r\n\r\n", 4);
+        if (end != NULL) {
+            conn_header_done(connfd);
+            *header = end + 4 - *buffer;
+            return memchr(*buffer, '\0', *header) == NULL ? (ssize_t) used : 0;
+        }
+    }
+}
+
+// Parses the request in place: method and uri become NUL-terminated views
+// into the pooled receive buffer, so nothing is copied out of it.
+static void *handle_connection(int connfd) {
+    char msg[STATUS_SIZE];
+    char *buffer = bufferGet(BUFFER_MIN);
+    int rejected = 0;
+
+    size_t header = 0;
+    ssize_t bytes_read = recv_header(connfd, &buffer, &header);
+    if (bytes_read < 0) {
+        send_status(msg, connfd, 408, "Request Timeout");
+        bufferPut(buffer);
+        return NULL;
+    }
+    if (bytes_read == 0 || regexec(&regr, buffer, 0, NULL, 0) == REG_NOMATCH) {
+        send_status(msg, connfd, 400, "Bad Request");
+        bufferPut(buffer);
+        return NULL;
+    }
+    char *method = buffer;
+    char *uri = strchr(method, ' ');
+    *uri++ = '\0';
+    char *headers = strchr(uri, ' ');
+    *headers++ = '\0';
+    uri++; // delete "/" in front
+    char *token = buffer + header;
+    int body = bytes_read - header;
 
     int request = 0;
 
-    char *r = strstr(buffer, "Request-Id:");
+    char *r = strstr(headers, "Request-Id:");
     if (r != NULL) {
         sscanf(r, "Request-Id: %d", &request);
     }
 
+    // Content-Length is left in place; the handlers' strtol stops at "\r\n"
+    char *length = strstr(headers, "Content-Length:");
+    if (length != NULL) {
+        length += strlen("Content-Length:");
+    }
+
     if (strcmp(method, "GET") == 0 || (strcmp(method, "get") == 0)) {
-        pthread_mutex_lock(&readwrite_lock);
-        while (writers > 0) { // currently writing to file, so wait until done
-            pthread_cond_wait(&reading, &readwrite_lock);
-        }
-        readers += 1;
-        pthread_mutex_unlock(&readwrite_lock);
-        get_handler(connfd, uri, request);
-        pthread_mutex_lock(&readwrite_lock);
-        readers -= 1;
-        if (readers == 0) { // able to write since no more readers
-            pthread_cond_signal(&writing);
-        }
-        pthread_mutex_unlock(&readwrite_lock);
-    } else if (strcmp(method, "PUT") == 0 || (strcmp(method, "put") == 0)) {
-        pthread_mutex_lock(&readwrite_lock);
-        while (writers > 0 || readers > 0) { // allow one writer at a time
-            pthread_cond_wait(&writing, &readwrite_lock);
+        reader_acquire();
+        if (store != NULL) {
+            store_get(connfd, uri, request);
+        } else {
+            get_handler(connfd, uri, request);
         }
-        writers = 1;
-        if (regexec(&regc, buffer, 0, NULL, 0) == REG_NOMATCH) {
+        reader_release();
+    } else if (strcmp(method, "PUT") == 0 || (strcmp(method, "put") == 0)) {
+        writer_acquire();
+        if (length == NULL || regexec(&regc, headers, 0, NULL, 0) == REG_NOMATCH) {
             send_status(msg, connfd, 400, "Bad Request");
+        } else if ((rejected = expect_continue(connfd, headers, "PUT", uri)) != 0) {
+            // rejected before the body was sent
+        } else if (store != NULL) {
+            store_write(connfd, uri, length, token, body, request, 0);
         } else {
-            char *c = strstr(buffer, "Content-Length");
-            sscanf(c, "%s %s", msg, length);
-            char *token = strstr(buffer, "\r\n\r\n");
-            token += 4;
-
-            put_handler(connfd, uri, length, token, bytes_read - (token - buffer), request);
+            put_handler(connfd, uri, length, token, body, request);
+        }
+        writer_release();
+        if (rejected > 0) {
+            expect_reject(connfd, rejected, "PUT", uri, request);
         }
-        writers = 0;
-        pthread_cond_signal(&writing);
-        pthread_cond_broadcast(&reading); // broadcast all threads because more than 1 readers
-        pthread_mutex_unlock(&readwrite_lock);
     } else if (strcmp(method, "APPEND") == 0 || (strcmp(method, "append") == 0)) {
-        pthread_mutex_lock(&readwrite_lock);
-        while (writers > 0 || readers > 0) {
-            pthread_cond_wait(&writing, &readwrite_lock);
+        writer_acquire();
+        if (length == NULL || regexec(&regc, headers, 0, NULL, 0) == REG_NOMATCH) {
+            send_status(msg, connfd, 400, "Bad Request");
+        } else if ((rejected = expect_continue(connfd, headers, "APPEND", uri)) != 0) {
+            // rejected before the body was sent
+        } else if (store != NULL) {
+            store_write(connfd, uri, length, token, body, request, 1);
+        } else {
+            append_handler(connfd, uri, length, token, body, request);
+        }
+        writer_release();
+        if (rejected > 0) {
+            expect_reject(connfd, rejected, "APPEND", uri, request);
         }
-        writers = 1;
-        if (regexec(&regc, buffer, 0, NULL, 0) == REG_NOMATCH) {
+    } else if (strcmp(method, "BATCH") == 0 || (strcmp(method, "batch") == 0)) {
+        if (length == NULL || regexec(&regc, headers, 0, NULL, 0) == REG_NOMATCH) {
             send_status(msg, connfd, 400, "Bad Request");
         } else {
-            char *c = strstr(buffer, "Content-Length:");
-            sscanf(c, "%s %s", msg, length);
-            char *token = strstr(buffer, "\r\n\r\n");
-            token += 4;
-
-            append_handler(connfd, uri, length, token, bytes_read - (token - buffer), request);
+            batch_handler(connfd, length, token, body, request);
         }
-        writers = 0;
-        pthread_cond_signal(&writing);
-        pthread_cond_broadcast(&reading);
-        pthread_mutex_unlock(&readwrite_lock);
     } else {
         send_status(msg, connfd, 501, "Not Implemented");
     }
 
-    regfree(&regr);
-    regfree(&regc);
+    bufferPut(buffer);
     return NULL;
 }
 
-static void sigterm_handler(int sig) {
-    if (sig == SIGTERM) {
-        warnx("received SIGTERM");
-        flag = 1;
-        pthread_cond_broadcast(&notempty);
-
-        for (int i = 0; i < ThreadInfo.count; i++) {
-            if (pthread_join(ThreadInfo.dispatcher[i], NULL) != 0) { //EINVAL occuring
-                err(1, "pthread_join failed");
-            }
-        }
-        freeList(&queue);
-        fclose(logfile);
-        free(ThreadInfo.dispatcher);
-        exit(EXIT_SUCCESS);
-    } else if (sig == SIGINT) {
-        warnx("received SIGINT");
-        flag = 1;
-        pthread_cond_broadcast(&notempty);
-
-        for (int i = 0; i < ThreadInfo.count; i++) {
-            if (pthread_join(ThreadInfo.dispatcher[i], NULL) != 0) {
-                err(1, "pthread_join failed");
-            }
+// Checks the client of a connection just accepted against the rate limits.
+// Returns 1 if it is to be served. A client over a limit is answered 429 right
+// here, without taking a worker, and 0 is returned.
+static int admit(int connfd, struct sockaddr_storage *peer) {
+    if (limiter == NULL) {
+        return 1;
+    }
+    int slot = rateAdmit(limiter, (struct sockaddr *) peer);
+    if (slot != RATE_DENY) {
+        if (connfd < conns_max) {
+            conns[connfd].slot = slot;
+        } else {
+            rateDone(limiter, slot, 0);
         }
-        freeList(&queue);
-        fclose(logfile);
-        free(ThreadInfo.dispatcher);
-        exit(EXIT_SUCCESS);
+        return 1;
     }
+    char msg[STATUS_SIZE], request[BUF_SIZE];
+    // take what has arrived of the request, so that close sends a FIN and
+    // not a reset that could discard the 429
+    recv(connfd, request, sizeof request, MSG_DONTWAIT);
+    send_status(msg, connfd, 429, "Too Many Requests");
+    shutdown(connfd, SHUT_WR);
+    close(connfd);
+    return 0;
+}
+
+static void serve(int cfd) {
+    conn_begin(cfd);
+    handle_connection(cfd);
+    conn_end(cfd);
+    close(cfd);
 }
 
 void *thread_handler(void *arg) {
     int worker = *((int *) arg);
     printf("thread: %d\n", worker);
 
-    while (flag == 0) {
-        int cfd = -1;
+    // once flag is set, keep going until the queue is drained
+    for (;;) {
         pthread_mutex_lock(&lock);
-        while (length(queue) == 0) {
+        while (length(queue) == 0 && flag == 0) {
             pthread_cond_wait(&notempty, &lock);
-            if (flag != 0) {
-                pthread_mutex_unlock(&lock);
-                return NULL;
-            }
         }
+        if (length(queue) == 0) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        int cfd = front(queue);
+        deleteFront(queue);
+        pthread_mutex_unlock(&lock);
+        serve(cfd);
+    }
+}
+
+static void green_serve(void *arg) {
+    serve((intptr_t) arg);
+}
+
+// Hands connections from the shared queue to this thread's scheduler.
+static void green_accept(void *arg) {
+    Scheduler S = arg;
+    uint64_t one;
+
+    for (;;) {
+        if (read(queue_event, &one, sizeof one) < 0) {
+            coWaitFd(queue_event, EPOLLIN);
+            continue;
+        }
+        int cfd = -1;
+        pthread_mutex_lock(&lock);
         if (length(queue) > 0) {
             cfd = front(queue);
             deleteFront(queue);
         }
         pthread_mutex_unlock(&lock);
         if (cfd != -1) {
-            handle_connection(cfd);
-            close(cfd);
+            fcntl(cfd, F_SETFL, O_NONBLOCK);
+            coSpawn(S, green_serve, (void *) (intptr_t) cfd);
+        }
+    }
+}
+
+// Runs every connection of this worker as a coroutine, so a worker is only
+// busy while one of them has something to do.
+void *green_handler(void *arg) {
+    int worker = *((int *) arg);
+    printf("green thread: %d\n", worker);
+
+    Scheduler S = newScheduler();
+    coSpawn(S, green_accept, S);
+    for (;;) {
+        coRun(S, GREEN_IDLE_MS);
+        if (flag == 0 || coLive(S) > 1) {
+            continue;
+        }
+        // only green_accept is left; stop once nothing is queued either
+        pthread_mutex_lock(&lock);
+        int queued = length(queue);
+        pthread_mutex_unlock(&lock);
+        if (queued == 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Takes the oldest connection from shard s, or the newest one when stealing.
+// Returns -1 if there is none.
+static int shard_pop(struct Shard *s, int steal) {
+    int cfd = -1;
+    if (steal) {
+        if (pthread_mutex_trylock(&s->lock) != 0) {
+            return -1;
+        }
+    } else {
+        pthread_mutex_lock(&s->lock);
+    }
+    if (length(s->queue) > 0) {
+        if (steal) {
+            cfd = back(s->queue);
+            deleteBack(s->queue);
+        } else {
+            cfd = front(s->queue);
+            deleteFront(s->queue);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return cfd;
+}
+
+// Accepts up to max connections from each listener of shard s onto the queue
+// of shard into. Returns how many were queued.
+static int shard_accept(struct Shard *s, struct Shard *into, int max) {
+    int queued = 0;
+    for (int l = 0; flag == 0 && l < s->nlisten; l++) {
+        for (int i = 0; i < max; i++) {
+            struct sockaddr_storage peer;
+            socklen_t peerlen = sizeof peer;
+            int connfd = accept(s->listenfd[l], (struct sockaddr *) &peer, &peerlen);
+            if (connfd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    warn("accept error");
+                }
+                break;
+            }
+            if (!admit(connfd, &peer)) {
+                continue;
+            }
+            pthread_mutex_lock(&into->lock);
+            append(into->queue, connfd);
+            pthread_mutex_unlock(&into->lock);
+            queued++;
+        }
+    }
+    return queued;
+}
+
+// Accepts, queues and serves connections of one shard. Neighbours are only
+// touched once the own listeners and queue are both empty: first their
+// queues, then their listeners.
+void *shard_handler(void *arg) {
+    struct Shard *self = arg;
+    int id = self - shards;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(self->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+        warnx("shard %d: could not pin to cpu %d", id, self->cpu);
+    }
+    printf("shard: %d cpu: %d\n", id, self->cpu);
+
+    struct pollfd pfd[LISTEN_SPECS];
+    for (int l = 0; l < self->nlisten; l++) {
+        pfd[l] = (struct pollfd) { self->listenfd[l], POLLIN, 0 };
+    }
+
+    for (;;) {
+        shard_accept(self, self, ACCEPT_BATCH);
+
+        int cfd = shard_pop(self, 0);
+        for (int i = 1; cfd == -1 && i < shard_count; i++) {
+            cfd = shard_pop(&shards[(id + i) % shard_count], 1);
+        }
+        // a neighbour busy with a slow client is not accepting, so what the
+        // kernel hashed to its listeners waits unless taken from there too
+        for (int i = 1; cfd == -1 && flag == 0 && i < shard_count; i++) {
+            if (shard_accept(&shards[(id + i) % shard_count], self, 1) > 0) {
+                cfd = shard_pop(self, 0);
+            }
+        }
+        if (cfd != -1) {
+            serve(cfd);
+            continue;
+        }
+        if (flag != 0) {
+            break;
         }
+
+        poll(pfd, self->nlisten, SHARD_IDLE_MS);
     }
 
     return NULL;
 }
 
+// Accepts up to ACCEPT_BATCH connections from listenfd onto the worker queue.
+// Returns how many were accepted.
+static int accept_batch(int listenfd) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_storage peer;
+        socklen_t peerlen = sizeof peer;
+        int connfd = accept(listenfd, (struct sockaddr *) &peer, &peerlen);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                warn("accept error");
+            }
+            return i;
+        }
+        if (!admit(connfd, &peer)) {
+            continue;
+        }
+        pthread_mutex_lock(&lock);
+        append(queue, connfd); // worker queue
+        pthread_cond_signal(&notempty);
+        pthread_mutex_unlock(&lock);
+        if (queue_event != -1) {
+            uint64_t one = 1;
+            write(queue_event, &one, sizeof one);
+        }
+    }
+    return ACCEPT_BATCH;
+}
+
+// Stops listening. Connections that already completed their handshake are
+// still taken into the queues, then every listener is closed, so later
+// clients are refused instead of waiting in a backlog nobody accepts from.
+// After an upgrade the new process holds its own copies, which stay open.
+static void stop_listening(int sharded) {
+    if (sharded) {
+        for (int i = 0; i < shard_count; i++) {
+            while (shard_accept(&shards[i], &shards[i], ACCEPT_BATCH) > 0) {
+            }
+        }
+    } else {
+        for (int i = 0; i < listener_count; i++) {
+            while (accept_batch(listeners[i]) == ACCEPT_BATCH) {
+            }
+        }
+    }
+    for (int i = 0; i < listener_count; i++) {
+        close(listeners[i]);
+    }
+}
+
+// Reads one signal from sigfd. Returns 1 if this process should stop
+// accepting and drain.
+static int handle_signal(int sigfd) {
+    struct signalfd_siginfo si;
+    if (read(sigfd, &si, sizeof si) != sizeof si) {
+        return 0;
+    }
+    if (si.ssi_signo == SIGUSR2) {
+        warnx("received SIGUSR2, starting new process");
+        return upgrade() == 0;
+    }
+    warnx("received %s", si.ssi_signo == SIGTERM ? "SIGTERM" : "SIGINT");
+    return 1;
+}
+
+// Stops listening and lets the workers finish every connection already
+// accepted, for at most DRAIN_TIMEOUT_MS, then exits.
+static void drain_and_exit(int sharded) {
+    stop_listening(sharded);
+    pthread_mutex_lock(&lock);
+    flag = 1;
+    pthread_cond_broadcast(&notempty);
+    pthread_mutex_unlock(&lock);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT_MS / 1000;
+    for (int i = 0; i < ThreadInfo.count; i++) {
+        if (pthread_timedjoin_np(ThreadInfo.dispatcher[i], NULL, &deadline) != 0) {
+            warnx("drain timed out, dropping open connections");
+            fflush(logfile);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    if (store != NULL) {
+        writer_acquire(); // freeStore waits out a compaction's copy
+        freeStore(&store);
+    }
+    freeList(&queue);
+    fclose(logfile);
+    free(ThreadInfo.dispatcher);
+    exit(EXIT_SUCCESS);
+}
+
 static void usage(char *exec) {
-    fprintf(stderr, "usage: %s [-t threads] [-l logfile] <port>\n", exec);
+    fprintf(stderr, "usage: %s [-t threads] [-l logfile] [-s | -g] [-d storedir] [-L listener]...\n"
+                    "       [-r requests/s] [-b bytes/s] [-c connections] [port]\n",
+        exec);
 }
 
 int main(int argc, char *argv[]) {
     int opt = 0;
     int threads = DEFAULT_THREAD_COUNT;
+    int threads_set = 0, sharded = 0, green = 0;
+    char *store_dir = NULL;
+    long max_requests = 0, max_bytes = 0, max_conns = 0;
     logfile = stderr;
+    args = argv;
+    inherit_listeners();
 
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
@@ -439,10 +1991,20 @@ int main(int argc, char *argv[]) {
             if (threads <= 0) {
                 errx(EXIT_FAILURE, "bad number of threads");
             }
+            threads_set = 1;
             break;
+        case 's': sharded = 1; break;
+        case 'g': green = 1; break;
+        case 'd': store_dir = optarg; break;
+        case 'L': parse_listen(optarg); break;
+        case 'r': max_requests = strtol(optarg, NULL, 10); break;
+        case 'b': max_bytes = strtol(optarg, NULL, 10); break;
+        case 'c': max_conns = strtol(optarg, NULL, 10); break;
         case 'l':
-            logfile = fopen(optarg, "w");
-            if (!logfile) {
+            // opened for appending so that a process replacing this one can
+            // share it; only a fresh start truncates it
+            logfile = fopen(optarg, "a");
+            if (!logfile || (upgrade_fd < 0 && ftruncate(fileno(logfile), 0) < 0)) {
                 errx(EXIT_FAILURE, "bad logfile");
             }
             break;
@@ -450,46 +2012,150 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (optind >= argc) {
+    if (optind < argc) {
+        char spec[16];
+        snprintf(spec, sizeof spec, "tcp:%.8s", argv[optind]);
+        if (strtouint16(argv[optind]) == 0) {
+            errx(EXIT_FAILURE, "bad port number: %s", argv[optind]);
+        }
+        parse_listen(spec);
+    }
+    if (spec_count == 0) {
         warnx("wrong number of arguments");
         usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    uint16_t port = strtouint16(argv[optind]);
-    if (port == 0) {
-        errx(EXIT_FAILURE, "bad port number: %s", argv[optind]);
+    if (sharded && green) {
+        errx(EXIT_FAILURE, "-s and -g cannot be combined");
+    }
+
+    if (max_requests < 0 || max_bytes < 0 || max_conns < 0 || max_conns > INT32_MAX) {
+        errx(EXIT_FAILURE, "bad rate limit");
     }
 
+    // signals are read from sigfd by main; blocked before any thread starts
+    // so no other thread takes them
     signal(SIGPIPE, SIG_IGN);
-    signal(SIGTERM, sigterm_handler);
-    signal(SIGINT, sigterm_handler);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sigfd < 0) {
+        err(EXIT_FAILURE, "signalfd error");
+    }
 
-    int listenfd = create_listen_socket(port);
-    int worker[threads];
+    if (regcomp(&regr, REQUEST, REG_EXTENDED) || regcomp(&regc, HEADER, REG_EXTENDED)) {
+        errx(EXIT_FAILURE, "failed to compile regex");
+    }
 
-    ThreadInfo.count = threads;
-    ThreadInfo.dispatcher = malloc(threads * sizeof(pthread_t));
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (sharded) {
+        shard_count = threads_set ? threads : (cpus > 0 ? cpus : 1);
+        shards = calloc(shard_count, sizeof(struct Shard));
+        // each shard gets its own socket per TCP spec; a Unix socket cannot
+        // be bound twice, so all shards accept from the same one
+        for (int i = 0; i < shard_count; i++) {
+            for (int j = 0; j < spec_count; j++) {
+                int local = specs[j].family == AF_UNIX;
+                int fd = local && i > 0 ? shards[0].listenfd[j] : take_listener(&specs[j], !local);
+                shards[i].listenfd[shards[i].nlisten++] = fd;
+            }
+        }
+    } else {
+        for (int j = 0; j < spec_count; j++) {
+            take_listener(&specs[j], 0);
+        }
+    }
+    upgrade_ready(store_dir != NULL);
+
+    if (store_dir != NULL) {
+        store = newStore(store_dir);
+        if (store == NULL) {
+            err(EXIT_FAILURE, "bad store directory");
+        }
+    }
+
+    if (max_requests > 0 || max_bytes > 0 || max_conns > 0) {
+        limiter = newRateLimit(max_requests, max_bytes, max_conns);
+    }
+
+    // requests keep their buffers in the pool, so workers need little stack
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK);
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    conns_max = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1 << 20 ? 1 << 20 : rl.rlim_cur;
+    conns = calloc(conns_max, sizeof(struct Conn));
+    wheel = newTimerWheel(now_ticks());
+    pthread_t timer;
+    if (pthread_create(&timer, NULL, timer_handler, NULL) != 0) {
+        err(EXIT_FAILURE, "pthread_create() failed");
+    }
+    pthread_t compactor;
+    if (store != NULL && pthread_create(&compactor, NULL, compact_handler, NULL) != 0) {
+        err(EXIT_FAILURE, "pthread_create() failed");
+    }
 
     queue = newList();
-    for (int i = 0; i < threads; i++) {
-        worker[i] = i;
-        if (pthread_create(&(ThreadInfo.dispatcher[i]), NULL, thread_handler, &worker[i]) != 0) {
-            err(EXIT_FAILURE, "pthread_create() failed");
+    if (sharded) {
+        ThreadInfo.count = shard_count;
+        ThreadInfo.dispatcher = malloc(shard_count * sizeof(pthread_t));
+        for (int i = 0; i < shard_count; i++) {
+            shards[i].cpu = cpus > 0 ? i % cpus : 0;
+            shards[i].queue = newList();
+            pthread_mutex_init(&shards[i].lock, NULL);
+        }
+        for (int i = 0; i < shard_count; i++) {
+            if (pthread_create(&(ThreadInfo.dispatcher[i]), &attr, shard_handler, &shards[i]) != 0) {
+                err(EXIT_FAILURE, "pthread_create() failed");
+            }
+        }
+    } else {
+        int *worker = malloc(threads * sizeof(int));
+        ThreadInfo.count = threads;
+        ThreadInfo.dispatcher = malloc(threads * sizeof(pthread_t));
+        if (green) {
+            queue_event = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+            if (queue_event < 0) {
+                err(EXIT_FAILURE, "eventfd error");
+            }
+        }
+        for (int i = 0; i < threads; i++) {
+            worker[i] = i;
+            if (pthread_create(&(ThreadInfo.dispatcher[i]), &attr,
+                    green ? green_handler : thread_handler, &worker[i])
+                != 0) {
+                err(EXIT_FAILURE, "pthread_create() failed");
+            }
         }
     }
 
+    // shards accept for themselves, otherwise main also waits on the listeners
+    struct pollfd pfd[1 + LISTEN_SPECS] = { { sigfd, POLLIN, 0 } };
+    int nfds = sharded ? 1 : 1 + listener_count;
+    for (int l = 1; l < nfds; l++) {
+        pfd[l] = (struct pollfd) { listeners[l - 1], POLLIN, 0 };
+    }
     for (;;) {
-        int connfd = accept(listenfd, NULL, NULL);
-        if (connfd < 0) {
-            warn("accept error");
+        if (poll(pfd, nfds, -1) < 0) {
             continue;
         }
-        pthread_mutex_lock(&lock);
-        append(queue, connfd); // worker queue
-        pthread_cond_signal(&notempty);
-        pthread_mutex_unlock(&lock);
+        if ((pfd[0].revents & POLLIN) && handle_signal(sigfd)) {
+            break;
+        }
+        for (int l = 1; l < nfds; l++) {
+            if (pfd[l].revents & POLLIN) {
+                accept_batch(pfd[l].fd);
+            }
+        }
     }
 
+    drain_and_exit(sharded);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,391 @@
+// Component microbenchmarks for httpserver. Built from the server's own
+// source so the static parser, lock and handler code is measured as is.
+// Prints one JSON object per line:
+//   {"bench": ..., "case": ..., "ops": ..., "ns_per_op": ...}
+
+#define main httpserver_main
+#include "httpserver.c"
+#undef main
+
+#include <sched.h>
+#include <stdatomic.h>
+
+#define QUEUE_ITEMS  200000
+#define RING_SIZE    1024
+#define PARSE_ITERS  20000
+#define LOCK_ITERS   200000
+#define HANDLER_SECS 0.5
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *bench, const char *name, long ops, double ns) {
+    printf("{\"bench\": \"%s\", \"case\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f}\n", bench,
+        name, ops, ns / ops);
+    fflush(stdout);
+}
+
+// ----- Queues -----
+
+// Every queue is driven the same way as the worker queue: producers push
+// connfds, consumers block or spin until one is available.
+struct Queue {
+    const char *name;
+    void (*push)(struct Queue *q, int x);
+    int (*pop)(struct Queue *q);
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+    List list;
+    int ring[RING_SIZE];
+    long head, tail;
+    struct Cell {
+        _Atomic long seq;
+        int x;
+    } cells[RING_SIZE];
+    _Atomic long enq, deq;
+};
+
+static void list_push(struct Queue *q, int x) {
+    pthread_mutex_lock(&q->lock);
+    append(q->list, x);
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int list_pop(struct Queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (length(q->list) == 0) {
+        pthread_cond_wait(&q->notempty, &q->lock);
+    }
+    int x = front(q->list);
+    deleteFront(q->list);
+    pthread_mutex_unlock(&q->lock);
+    return x;
+}
+
+static void ring_push(struct Queue *q, int x) {
+    pthread_mutex_lock(&q->lock);
+    while (q->tail - q->head == RING_SIZE) {
+        pthread_cond_wait(&q->notfull, &q->lock);
+    }
+    q->ring[q->tail++ % RING_SIZE] = x;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int ring_pop(struct Queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->tail == q->head) {
+        pthread_cond_wait(&q->notempty, &q->lock);
+    }
+    int x = q->ring[q->head++ % RING_SIZE];
+    pthread_cond_signal(&q->notfull);
+    pthread_mutex_unlock(&q->lock);
+    return x;
+}
+
+// Bounded lock-free MPMC queue with per-cell sequence numbers.
+static void mpmc_push(struct Queue *q, int x) {
+    for (;;) {
+        long pos = atomic_load_explicit(&q->enq, memory_order_relaxed);
+        struct Cell *c = &q->cells[pos % RING_SIZE];
+        long seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        if (seq == pos && atomic_compare_exchange_weak(&q->enq, &pos, pos + 1)) {
+            c->x = x;
+            atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+            return;
+        }
+        if (seq < pos) {
+            sched_yield();
+        }
+    }
+}
+
+static int mpmc_pop(struct Queue *q) {
+    for (;;) {
+        long pos = atomic_load_explicit(&q->deq, memory_order_relaxed);
+        struct Cell *c = &q->cells[pos % RING_SIZE];
+        long seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        if (seq == pos + 1 && atomic_compare_exchange_weak(&q->deq, &pos, pos + 1)) {
+            int x = c->x;
+            atomic_store_explicit(&c->seq, pos + RING_SIZE, memory_order_release);
+            return x;
+        }
+        if (seq < pos + 1) {
+            sched_yield();
+        }
+    }
+}
+
+struct QueueWork {
+    struct Queue *q;
+    long items;
+};
+
+static void *producer(void *arg) {
+    struct QueueWork *w = arg;
+    for (long i = 0; i < w->items; i++) {
+        w->q->push(w->q, (int) i);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    struct QueueWork *w = arg;
+    for (long i = 0; i < w->items; i++) {
+        w->q->pop(w->q);
+    }
+    return NULL;
+}
+
+static void bench_queue(struct Queue *q, int pairs) {
+    pthread_t tid[2 * pairs];
+    struct QueueWork w = { q, QUEUE_ITEMS / pairs };
+    char name[64];
+
+    double t0 = now_ns();
+    for (int i = 0; i < pairs; i++) {
+        pthread_create(&tid[2 * i], NULL, consumer, &w);
+        pthread_create(&tid[2 * i + 1], NULL, producer, &w);
+    }
+    for (int i = 0; i < 2 * pairs; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    sprintf(name, "%s/%dx%d", q->name, pairs, pairs);
+    report("queue", name, w.items * pairs, now_ns() - t0);
+}
+
+static void bench_queues(void) {
+    for (int pairs = 1; pairs <= 4; pairs *= 2) {
+        struct Queue *q = calloc(3, sizeof(struct Queue));
+        q[0].name = "list";
+        q[0].push = list_push;
+        q[0].pop = list_pop;
+        q[0].list = newList();
+        q[1].name = "ring";
+        q[1].push = ring_push;
+        q[1].pop = ring_pop;
+        q[2].name = "mpmc";
+        q[2].push = mpmc_push;
+        q[2].pop = mpmc_pop;
+        for (int i = 0; i < RING_SIZE; i++) {
+            q[2].cells[i].seq = i;
+        }
+        for (int i = 0; i < 3; i++) {
+            pthread_mutex_init(&q[i].lock, NULL);
+            pthread_cond_init(&q[i].notempty, NULL);
+            pthread_cond_init(&q[i].notfull, NULL);
+            bench_queue(&q[i], pairs);
+        }
+        freeList(&q[0].list);
+        free(q);
+    }
+}
+
+// ----- Parser -----
+
+// Runs the same steps as handle_connection up to dispatch: both regexes, the
+// in-place split and the header lookups.
+static void bench_parse(void) {
+    static const int pads[] = { 0, 512, 4096, 16384 };
+
+    for (size_t p = 0; p < sizeof pads / sizeof pads[0]; p++) {
+        size_t cap = 256 + pads[p];
+        char *request = malloc(cap), *work = malloc(cap);
+        int n = sprintf(request, "PUT /file.txt HTTP/1.1\r\nRequest-Id: 7\r\nX-Pad: ");
+        memset(request + n, 'a', pads[p]);
+        n += pads[p];
+        n += sprintf(request + n, "\r\nContent-Length: 12\r\n\r\n");
+
+        long sum = 0;
+        double t0 = now_ns();
+        for (int i = 0; i < PARSE_ITERS; i++) {
+            memcpy(work, request, n + 1);
+            if (regexec(&regr, work, 0, NULL, 0) == REG_NOMATCH) {
+                errx(EXIT_FAILURE, "request did not parse");
+            }
+            char *uri = strchr(work, ' ');
+            *uri++ = '\0';
+            char *headers = strchr(uri, ' ');
+            *headers++ = '\0';
+            int request_id = 0;
+            char *r = strstr(headers, "Request-Id:");
+            if (r != NULL) {
+                sscanf(r, "Request-Id: %d", &request_id);
+            }
+            char *length = strstr(headers, "Content-Length:");
+            regexec(&regc, headers, 0, NULL, 0);
+            sum += request_id + strtol(length + 15, NULL, 0);
+        }
+        char name[32];
+        sprintf(name, "%d_bytes", n);
+        report("parse", name, PARSE_ITERS, now_ns() - t0);
+        if (sum != (long) PARSE_ITERS * 19) {
+            errx(EXIT_FAILURE, "bad parse");
+        }
+        free(request);
+        free(work);
+    }
+}
+
+// ----- Reader/writer lock -----
+
+struct LockWork {
+    int writer_pct;
+    long iters;
+};
+
+static void *lock_worker(void *arg) {
+    struct LockWork *w = arg;
+    unsigned seed = (unsigned) (uintptr_t) &seed;
+    for (long i = 0; i < w->iters; i++) {
+        if ((int) (rand_r(&seed) % 100) < w->writer_pct) {
+            writer_acquire();
+            writer_release();
+        } else {
+            reader_acquire();
+            reader_release();
+        }
+    }
+    return NULL;
+}
+
+static void bench_locks(void) {
+    static const int writer_pcts[] = { 0, 10, 50, 100 };
+
+    for (int threads = 1; threads <= 4; threads *= 2) {
+        for (size_t p = 0; p < sizeof writer_pcts / sizeof writer_pcts[0]; p++) {
+            struct LockWork w = { writer_pcts[p], LOCK_ITERS / threads };
+            pthread_t tid[threads];
+            double t0 = now_ns();
+            for (int i = 0; i < threads; i++) {
+                pthread_create(&tid[i], NULL, lock_worker, &w);
+            }
+            for (int i = 0; i < threads; i++) {
+                pthread_join(tid[i], NULL);
+            }
+            char name[64];
+            sprintf(name, "%dthreads/%dpct_writers", threads, writer_pcts[p]);
+            report("rwlock", name, w.iters * threads, now_ns() - t0);
+        }
+    }
+}
+
+// ----- Handlers -----
+
+struct Peer {
+    int fd;
+    long body;
+    _Atomic int stop;
+};
+
+// Discards whatever the handler sends.
+static void *drain(void *arg) {
+    struct Peer *p = arg;
+    char *buf = malloc(LARGE_CHUNK);
+    while (recv(p->fd, buf, LARGE_CHUNK, 0) > 0) {
+    }
+    free(buf);
+    return NULL;
+}
+
+// Feeds request bodies to put_handler until told to stop.
+static void *feed(void *arg) {
+    struct Peer *p = arg;
+    char *buf = calloc(1, BUF_SIZE);
+    while (!atomic_load(&p->stop)) {
+        for (long left = p->body; left > 0; left -= BUF_SIZE) {
+            if (send(p->fd, buf, left < BUF_SIZE ? left : BUF_SIZE, 0) < 0) {
+                free(buf);
+                return NULL;
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void bench_handlers(void) {
+    static const long sizes[] = { 1024, 256 * 1024, 16 * 1024 * 1024 };
+    char uri[32], length[32], name[64];
+
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+        sprintf(uri, "bench_%ld", sizes[s]);
+        sprintf(length, "%ld", sizes[s]);
+        int fd = open(uri, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizes[s]) < 0) {
+            err(EXIT_FAILURE, "%s", uri);
+        }
+        close(fd);
+
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        struct Peer peer = { sv[1], sizes[s], 0 };
+        pthread_t drainer;
+        pthread_create(&drainer, NULL, drain, &peer);
+        long ops = 0;
+        double t0 = now_ns(), t;
+        do {
+            get_handler(sv[0], uri, 0);
+            ops++;
+        } while ((t = now_ns() - t0) < HANDLER_SECS * 1e9);
+        sprintf(name, "get/%ld_bytes", sizes[s]);
+        report("handler", name, ops, t);
+        shutdown(sv[0], SHUT_RDWR);
+        pthread_join(drainer, NULL);
+        close(sv[0]);
+        close(sv[1]);
+
+        // put_handler answers through the same socket the body came from, so
+        // the peer feeds bodies from one thread and drains replies in another
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        peer.fd = sv[1];
+        pthread_t feeder;
+        pthread_create(&drainer, NULL, drain, &peer);
+        pthread_create(&feeder, NULL, feed, &peer);
+        ops = 0;
+        t0 = now_ns();
+        do {
+            put_handler(sv[0], uri, length, NULL, 0, 0);
+            ops++;
+        } while ((t = now_ns() - t0) < HANDLER_SECS * 1e9);
+        sprintf(name, "put/%ld_bytes", sizes[s]);
+        report("handler", name, ops, t);
+        atomic_store(&peer.stop, 1);
+        shutdown(sv[0], SHUT_RDWR);
+        pthread_join(feeder, NULL);
+        pthread_join(drainer, NULL);
+        close(sv[0]);
+        close(sv[1]);
+        unlink(uri);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *only = argc > 1 ? argv[1] : NULL;
+
+    signal(SIGPIPE, SIG_IGN);
+    logfile = fopen("/dev/null", "w");
+    if (regcomp(&regr, REQUEST, REG_EXTENDED) || regcomp(&regc, HEADER, REG_EXTENDED)) {
+        errx(EXIT_FAILURE, "failed to compile regex");
+    }
+
+    if (only == NULL || strcmp(only, "queue") == 0) {
+        bench_queues();
+    }
+    if (only == NULL || strcmp(only, "parse") == 0) {
+        bench_parse();
+    }
+    if (only == NULL || strcmp(only, "rwlock") == 0) {
+        bench_locks();
+    }
+    if (only == NULL || strcmp(only, "handler") == 0) {
+        bench_handlers();
+    }
+    fclose(logfile);
+    return EXIT_SUCCESS;
+}
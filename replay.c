@@ -0,0 +1,432 @@
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#define OPTIONS         "h:p:m:c:r:x:b:z:s:P"
+#define BUF_SIZE        4096
+#define DEFAULT_CONC    16
+#define DEFAULT_RATE    100.0
+#define DEFAULT_SIZES   "fixed:1024"
+#define MAX_PORTS       2
+#define MAX_SIDECAR     4096
+
+// Replays access logs written by httpserver's send_log() against running
+// servers, checks that every status code matches the log and reports
+// throughput and latency. Given two ports, the same trace is replayed against
+// each server in turn and the deltas between them are printed.
+
+enum Mode { ORDERED, CLOSED, OPEN };
+
+struct Req {
+    char method[16];
+    char uri[64];
+    int code;
+    int id;
+    long size;
+};
+
+struct Sidecar {
+    char uri[64];
+    long size;
+};
+
+struct Stats {
+    double seconds;
+    double throughput;
+    double p50, p90, p99, max, mean;
+    long mismatches;
+    long errors;
+};
+
+// Shared by the replay threads of one run.
+struct Run {
+    struct Req *reqs;
+    long count;
+    double *latency;
+    int *codes;
+    long next;
+    double start;
+    double interval;
+    pthread_mutex_t lock;
+};
+
+static const char *host = "127.0.0.1";
+static uint16_t port;
+static enum Mode mode = CLOSED;
+static char pattern[BUF_SIZE];
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns a body size drawn from spec: fixed:N, uniform:MIN:MAX or exp:MEAN.
+static long draw_size(const char *spec, unsigned *seed) {
+    long a = 0, b = 0;
+    if (sscanf(spec, "fixed:%ld", &a) == 1) {
+        return a;
+    }
+    if (sscanf(spec, "uniform:%ld:%ld", &a, &b) == 2 && b >= a) {
+        return a + rand_r(seed) % (b - a + 1);
+    }
+    if (sscanf(spec, "exp:%ld", &a) == 1) {
+        double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+        return (long) (-log(u) * a);
+    }
+    errx(EXIT_FAILURE, "bad size distribution: %s", spec);
+}
+
+static long load_sidecar(const char *path, struct Sidecar *side) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        err(EXIT_FAILURE, "%s", path);
+    }
+    long n = 0;
+    char line[BUF_SIZE];
+    while (n < MAX_SIDECAR && fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "%63[^,],%ld", side[n].uri, &side[n].size) == 2) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+// Appends the requests of one log to *reqs. Bodies of PUT and APPEND take
+// their size from the sidecar if it lists the URI, else from the distribution.
+static long load_log(const char *path, struct Req **reqs, long count, long *cap,
+    struct Sidecar *side, long nside, const char *sizes, unsigned *seed) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        err(EXIT_FAILURE, "%s", path);
+    }
+    char line[BUF_SIZE];
+    while (fgets(line, sizeof line, f) != NULL) {
+        struct Req r = { 0 };
+        if (sscanf(line, "%15[^,],%63[^,],%d,%d", r.method, r.uri, &r.code, &r.id) != 4) {
+            continue;
+        }
+        if (strcmp(r.method, "GET") != 0) {
+            r.size = -1;
+            for (long i = 0; i < nside; i++) {
+                if (strcmp(side[i].uri, r.uri) == 0) {
+                    r.size = side[i].size;
+                }
+            }
+            if (r.size < 0) {
+                r.size = draw_size(sizes, seed);
+            }
+        }
+        if (count == *cap) {
+            *cap = *cap ? *cap * 2 : 1024;
+            *reqs = realloc(*reqs, *cap * sizeof(struct Req));
+        }
+        (*reqs)[count++] = r;
+    }
+    fclose(f);
+    return count;
+}
+
+static int connect_server(void) {
+    struct addrinfo hints = { 0 }, *res;
+    char service[8];
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(service, "%u", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends one request and reads the response until the server closes.
+// Returns the status code, or -1 on a connection error.
+static int do_request(const char *method, const char *uri, long size, int id) {
+    char msg[BUF_SIZE];
+    int fd = connect_server();
+    if (fd < 0) {
+        return -1;
+    }
+    int n;
+    if (size >= 0) {
+        n = sprintf(msg, "%s %s HTTP/1.1\r\nRequest-Id: %d\r\nContent-Length: %ld\r\n\r\n",
+            method, uri, id, size);
+    } else {
+        n = sprintf(msg, "%s %s HTTP/1.1\r\nRequest-Id: %d\r\n\r\n", method, uri, id);
+    }
+    int rc = send_all(fd, msg, n);
+    for (long left = size; rc == 0 && left > 0; left -= BUF_SIZE) {
+        rc = send_all(fd, pattern, left < BUF_SIZE ? left : BUF_SIZE);
+    }
+    if (rc < 0) {
+        close(fd);
+        return -1;
+    }
+
+    int code = -1;
+    ssize_t got = 0, bytes = 1;
+    while (got < 12 && (bytes = recv(fd, msg + got, BUF_SIZE - 1 - got, 0)) > 0) {
+        got += bytes;
+    }
+    msg[got] = '\0';
+    sscanf(msg, "HTTP/1.1 %d", &code);
+    while (bytes > 0 && (bytes = recv(fd, msg, BUF_SIZE, 0)) > 0) {
+    }
+    close(fd);
+    return code;
+}
+
+static void *replay_handler(void *arg) {
+    struct Run *run = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&run->lock);
+        long i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->count) {
+            return NULL;
+        }
+
+        // open loop: latency counts from when the request was due, so a slow
+        // server cannot hide its queueing delay by slowing us down
+        double t0 = now_seconds();
+        if (mode == OPEN) {
+            double due = run->start + i * run->interval;
+            if (due > t0) {
+                struct timespec ts = { (time_t) (due - t0), (long) (fmod(due - t0, 1.0) * 1e9) };
+                nanosleep(&ts, NULL);
+            }
+            t0 = due;
+        }
+        struct Req *r = &run->reqs[i];
+        run->codes[i] = do_request(r->method, r->uri, r->size, r->id);
+        run->latency[i] = (now_seconds() - t0) * 1000;
+    }
+}
+
+static int cmp_uri(const void *a, const void *b) {
+    const struct Req *x = *(struct Req *const *) a, *y = *(struct Req *const *) b;
+    int c = strcmp(x->uri, y->uri);
+    return c != 0 ? c : (x > y) - (x < y);
+}
+
+// PUTs every URI that the trace first touches with a GET or APPEND that
+// succeeded, so a fresh server directory can reproduce the log.
+static void prime(struct Req *reqs, long count) {
+    struct Req **order = malloc(count * sizeof(struct Req *));
+    for (long i = 0; i < count; i++) {
+        order[i] = &reqs[i];
+    }
+    qsort(order, count, sizeof(struct Req *), cmp_uri);
+    for (long i = 0; i < count; i++) {
+        struct Req *r = order[i];
+        if (i > 0 && strcmp(order[i - 1]->uri, r->uri) == 0) {
+            continue;
+        }
+        if (strcmp(r->method, "PUT") != 0 && r->code == 200) {
+            if (do_request("PUT", r->uri, r->size > 0 ? r->size : BUF_SIZE, 0) < 0) {
+                warnx("could not prime %s", r->uri);
+            }
+        }
+    }
+    free(order);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static struct Stats replay(struct Req *reqs, long count, int conc, double rate) {
+    struct Run run = { 0 };
+    struct Stats st = { 0 };
+
+    run.reqs = reqs;
+    run.count = count;
+    run.latency = calloc(count, sizeof(double));
+    run.codes = calloc(count, sizeof(int));
+    run.interval = 1.0 / rate;
+    pthread_mutex_init(&run.lock, NULL);
+
+    int threads = mode == ORDERED ? 1 : conc;
+    pthread_t *tid = malloc(threads * sizeof(pthread_t));
+    run.start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tid[i], NULL, replay_handler, &run) != 0) {
+            err(EXIT_FAILURE, "pthread_create() failed");
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    st.seconds = now_seconds() - run.start;
+
+    double sum = 0;
+    for (long i = 0; i < count; i++) {
+        if (run.codes[i] < 0) {
+            st.errors++;
+        } else if (run.codes[i] != reqs[i].code) {
+            st.mismatches++;
+            if (st.mismatches <= 10) {
+                warnx("%s %s: got %d, log has %d", reqs[i].method, reqs[i].uri, run.codes[i],
+                    reqs[i].code);
+            }
+        }
+        sum += run.latency[i];
+    }
+    qsort(run.latency, count, sizeof(double), cmp_double);
+    st.throughput = count / st.seconds;
+    st.mean = sum / count;
+    st.p50 = run.latency[(long) (count * 0.50)];
+    st.p90 = run.latency[(long) (count * 0.90)];
+    st.p99 = run.latency[(long) (count * 0.99)];
+    st.max = run.latency[count - 1];
+
+    free(tid);
+    free(run.latency);
+    free(run.codes);
+    pthread_mutex_destroy(&run.lock);
+    return st;
+}
+
+static void report(const char *name, double a, double b, int compare) {
+    if (compare) {
+        printf("%-14s %12.3f %12.3f %+9.1f%%\n", name, a, b, a != 0 ? (b - a) / a * 100 : 0);
+    } else {
+        printf("%-14s %12.3f\n", name, a);
+    }
+}
+
+static void usage(char *exec) {
+    fprintf(stderr,
+        "usage: %s [-h host] -p port [-p port] [-m ordered|closed|open] [-c concurrency]\n"
+        "       [-r rate] [-x speed] [-b sidecar] [-z sizes] [-s seed] [-P] <log>...\n",
+        exec);
+}
+
+int main(int argc, char *argv[]) {
+    int opt = 0, conc = DEFAULT_CONC, nports = 0, priming = 0;
+    uint16_t ports[MAX_PORTS];
+    double rate = DEFAULT_RATE, speed = 1.0;
+    const char *sizes = DEFAULT_SIZES;
+    unsigned seed = 1;
+    struct Sidecar *side = calloc(MAX_SIDECAR, sizeof(struct Sidecar));
+    long nside = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p':
+            if (nports == MAX_PORTS) {
+                errx(EXIT_FAILURE, "at most %d ports", MAX_PORTS);
+            }
+            ports[nports] = strtol(optarg, NULL, 10);
+            if (ports[nports++] == 0) {
+                errx(EXIT_FAILURE, "bad port number: %s", optarg);
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "ordered") == 0) {
+                mode = ORDERED;
+            } else if (strcmp(optarg, "closed") == 0) {
+                mode = CLOSED;
+            } else if (strcmp(optarg, "open") == 0) {
+                mode = OPEN;
+            } else {
+                errx(EXIT_FAILURE, "bad mode: %s", optarg);
+            }
+            break;
+        case 'c':
+            conc = strtol(optarg, NULL, 10);
+            if (conc <= 0) {
+                errx(EXIT_FAILURE, "bad concurrency");
+            }
+            break;
+        case 'r': rate = strtod(optarg, NULL); break;
+        case 'x': speed = strtod(optarg, NULL); break;
+        case 'b': nside = load_sidecar(optarg, side); break;
+        case 'z': sizes = optarg; break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'P': priming = 1; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (nports == 0 || optind >= argc || rate <= 0 || speed <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct Req *reqs = NULL;
+    long count = 0, cap = 0;
+    for (int i = optind; i < argc; i++) {
+        count = load_log(argv[i], &reqs, count, &cap, side, nside, sizes, &seed);
+    }
+    if (count == 0) {
+        errx(EXIT_FAILURE, "no requests in log");
+    }
+    memset(pattern, 'x', sizeof pattern);
+
+    struct Stats st[MAX_PORTS];
+    for (int i = 0; i < nports; i++) {
+        port = ports[i];
+        if (priming) {
+            prime(reqs, count);
+        }
+        st[i] = replay(reqs, count, conc, rate * speed);
+    }
+
+    int cmp = nports == 2;
+    const char *names[] = { "ordered", "closed", "open" };
+    printf("%ld requests, mode %s\n", count, names[mode]);
+    if (cmp) {
+        printf("%-14s %12u %12u %10s\n", "port", ports[0], ports[1], "delta");
+    }
+    report("seconds", st[0].seconds, st[cmp].seconds, cmp);
+    report("req/s", st[0].throughput, st[cmp].throughput, cmp);
+    report("mean ms", st[0].mean, st[cmp].mean, cmp);
+    report("p50 ms", st[0].p50, st[cmp].p50, cmp);
+    report("p90 ms", st[0].p90, st[cmp].p90, cmp);
+    report("p99 ms", st[0].p99, st[cmp].p99, cmp);
+    report("max ms", st[0].max, st[cmp].max, cmp);
+    report("mismatches", st[0].mismatches, st[cmp].mismatches, cmp);
+    report("errors", st[0].errors, st[cmp].errors, cmp);
+
+    free(reqs);
+    free(side);
+    for (int i = 0; i < nports; i++) {
+        if (st[i].mismatches > 0 || st[i].errors > 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}